@@ -0,0 +1,318 @@
+#define _POSIX_C_SOURCE 200809L /* getline under -ansi*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Binary dataset format read by kmeans.c (and kmeans_pp.py), in native byte order:
+ *   BINARY_HEADER_SIZE byte header (BinaryHeader, zero padded),
+ *   if hasKeys: n float64 keys, zero padded to a multiple of BINARY_ALIGNMENT bytes,
+ *   payload: n * d float64 or float32 values, point after point (row-major)
+ *            or coordinate after coordinate (column-major).
+ * Keys and payload start at multiples of BINARY_ALIGNMENT bytes, so a mapped file
+ * can be used in place.
+ */
+#define BINARY_MAGIC "KMBINARY"
+#define BINARY_BYTE_ORDER 0x01020304
+#define BINARY_VERSION 1
+#define BINARY_HEADER_SIZE 64
+#define BINARY_ALIGNMENT 64
+
+/*
+ * Header of a binary dataset. All fields are 32 bit ints.
+ */
+typedef struct
+{
+    char magic[8];   /* BINARY_MAGIC, without the terminating 0*/
+    int byteOrder;   /* BINARY_BYTE_ORDER as stored by the writer*/
+    int version;     /* BINARY_VERSION*/
+    int n;           /* number of points*/
+    int d;           /* coordinates per point*/
+    int elementSize; /* 8 for float64 payloads, 4 for float32*/
+    int columnMajor; /* true iff the payload is stored coordinate after coordinate*/
+    int hasKeys;     /* true iff a key column precedes the payload*/
+} BinaryHeader;
+
+/*
+ * Options of the converter.
+ */
+typedef struct
+{
+    int hasKeys;     /* true iff the first CSV column is a key*/
+    int columnMajor; /* true iff the payload is written column-major*/
+    int elementSize; /* 8 or 4*/
+} ConvertOptions;
+
+/*
+ * Counts the non-blank lines of input and the values in its first line.
+ * Rewinds input before returning.
+ */
+void countCsv(FILE *input, int *rows, int *columns);
+/*
+ * Parses exactly columns values from line into values.
+ * Returns 0 on success and 1 if the line holds fewer or more values, or anything else.
+ */
+int parseLine(char *line, double *values, int columns);
+/*
+ * True iff line holds nothing but separators.
+ */
+int isBlankLine(char *line);
+/*
+ * Offset of the payload in a file with the given header.
+ */
+long payloadOffset(BinaryHeader *header);
+/*
+ * Writes count values to output as elementSize byte floats.
+ * Returns 0 on success and 1 on a write error.
+ */
+int writeValues(FILE *output, double *values, int count, int elementSize);
+/*
+ * Converts the CSV file at inputPath into a binary dataset at outputPath.
+ * Returns 0 on success and 1 on any error, after removing a partly written outputPath.
+ */
+int convert(char *inputPath, char *outputPath, ConvertOptions *options);
+
+/*
+ * usage: kmeans_convert [--keys] [--column-major] [--float32] input.csv output.kmb
+ */
+int main(int argc, char *argv[])
+{
+    ConvertOptions options;
+    char *paths[2];
+    int pathCount = 0;
+    int a;
+
+    options.hasKeys = 0;
+    options.columnMajor = 0;
+    options.elementSize = 8;
+    for (a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--keys") == 0)
+        {
+            options.hasKeys = 1;
+        }
+        else if (strcmp(argv[a], "--column-major") == 0)
+        {
+            options.columnMajor = 1;
+        }
+        else if (strcmp(argv[a], "--float32") == 0)
+        {
+            options.elementSize = 4;
+        }
+        else if (strncmp(argv[a], "--", 2) != 0 && pathCount < 2)
+        {
+            paths[pathCount++] = argv[a];
+        }
+        else
+        {
+            printf("An Error Has Occurred");
+            return 1;
+        }
+    }
+    if (pathCount != 2 || convert(paths[0], paths[1], &options))
+    {
+        printf("An Error Has Occurred");
+        return 1;
+    }
+    return 0;
+}
+
+int isBlankLine(char *line)
+{
+    for (; *line != '\0'; line++)
+    {
+        if (*line != ',' && *line != ' ' && *line != '\t' && *line != '\r' && *line != '\n')
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void countCsv(FILE *input, int *rows, int *columns)
+{
+    char *line = NULL;
+    size_t capacity = 0;
+    char *cursor;
+
+    *rows = 0;
+    *columns = 0;
+    while (getline(&line, &capacity, input) != -1)
+    {
+        if (isBlankLine(line))
+        {
+            continue;
+        }
+        if (*rows == 0)
+        {
+            *columns = 1;
+            for (cursor = line; *cursor != '\0'; cursor++)
+            {
+                *columns += *cursor == ',';
+            }
+        }
+        (*rows)++;
+    }
+    free(line);
+    rewind(input);
+}
+
+int parseLine(char *line, double *values, int columns)
+{
+    char *end;
+    int j;
+    for (j = 0; j < columns; j++)
+    {
+        while (*line == ',' || *line == ' ' || *line == '\t')
+        {
+            line++;
+        }
+        values[j] = strtod(line, &end);
+        /* every value ends at a separator or at the end of the line (strchr also finds the terminating 0)*/
+        if (end == line || strchr(", \t\r\n", *end) == NULL)
+        {
+            return 1;
+        }
+        line = end;
+    }
+    return !isBlankLine(line);
+}
+
+long payloadOffset(BinaryHeader *header)
+{
+    long keysSize = header->hasKeys ? (long)header->n * 8 : 0;
+    return BINARY_HEADER_SIZE + (keysSize + BINARY_ALIGNMENT - 1) / BINARY_ALIGNMENT * BINARY_ALIGNMENT;
+}
+
+int writeValues(FILE *output, double *values, int count, int elementSize)
+{
+    float single;
+    int j;
+    if (elementSize == 8)
+    {
+        return fwrite(values, sizeof(double), count, output) != (size_t)count;
+    }
+    for (j = 0; j < count; j++)
+    {
+        single = (float)values[j];
+        if (fwrite(&single, sizeof(float), 1, output) != 1)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int convert(char *inputPath, char *outputPath, ConvertOptions *options)
+{
+    BinaryHeader header;
+    char headerBytes[BINARY_HEADER_SIZE];
+    FILE *input;
+    FILE *output;
+    FILE *keysOutput = NULL; /* second handle on output, positioned at the key column*/
+    char *line = NULL;
+    size_t capacity = 0;
+    double *row = NULL;
+    double *columns = NULL; /* column-major: the whole payload, coordinate after coordinate*/
+    int rows;
+    int width;
+    int i = 0;
+    int j;
+    int failed = 0;
+
+    input = fopen(inputPath, "r");
+    if (input == NULL)
+    {
+        return 1;
+    }
+    countCsv(input, &rows, &width);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+    header.byteOrder = BINARY_BYTE_ORDER;
+    header.version = BINARY_VERSION;
+    header.n = rows;
+    header.d = width - options->hasKeys;
+    header.elementSize = options->elementSize;
+    header.columnMajor = options->columnMajor;
+    header.hasKeys = options->hasKeys;
+    if (rows < 1 || header.d < 1)
+    {
+        fclose(input);
+        return 1;
+    }
+
+    output = fopen(outputPath, "wb");
+    if (output == NULL)
+    {
+        fclose(input);
+        return 1;
+    }
+    memset(headerBytes, 0, sizeof(headerBytes));
+    memcpy(headerBytes, &header, sizeof(header));
+    failed = fwrite(headerBytes, 1, sizeof(headerBytes), output) != sizeof(headerBytes) || fflush(output) != 0;
+    if (!failed && options->hasKeys)
+    {
+        keysOutput = fopen(outputPath, "r+b");
+        failed = keysOutput == NULL || fseek(keysOutput, BINARY_HEADER_SIZE, SEEK_SET) != 0;
+    }
+    row = (double *)malloc(width * sizeof(double));
+    if (options->columnMajor)
+    {
+        columns = (double *)malloc((size_t)rows * header.d * sizeof(double));
+        failed = failed || columns == NULL;
+    }
+    failed = failed || row == NULL || fseek(output, payloadOffset(&header), SEEK_SET) != 0;
+
+    while (!failed && i < rows && getline(&line, &capacity, input) != -1)
+    {
+        if (isBlankLine(line))
+        {
+            continue;
+        }
+        failed = parseLine(line, row, width);
+        if (!failed && options->hasKeys)
+        {
+            failed = fwrite(row, sizeof(double), 1, keysOutput) != 1;
+        }
+        if (failed)
+        {
+            break;
+        }
+        if (options->columnMajor)
+        {
+            for (j = 0; j < header.d; j++)
+            {
+                columns[(size_t)j * rows + i] = row[options->hasKeys + j];
+            }
+        }
+        else
+        {
+            failed = writeValues(output, row + options->hasKeys, header.d, options->elementSize);
+        }
+        i++;
+    }
+    failed = failed || i != rows;
+    for (j = 0; !failed && options->columnMajor && j < header.d; j++)
+    {
+        failed = writeValues(output, columns + (size_t)j * rows, rows, options->elementSize);
+    }
+
+    if (keysOutput != NULL && fclose(keysOutput) != 0)
+    {
+        failed = 1;
+    }
+    if (fclose(output) != 0)
+    {
+        failed = 1;
+    }
+    fclose(input);
+    free(line);
+    free(row);
+    free(columns);
+    if (failed)
+    {
+        remove(outputPath); /* no half-written dataset with a valid header is left behind*/
+    }
+    return failed;
+}
@@ -4,9 +4,17 @@
 PROGRAM_PATH="./kmeans.c"
 # Name of the executable to create
 EXECUTABLE="kmeans.out"
+# Converter from csv to the binary dataset format
+CONVERTER_PATH="./kmeans_convert.c"
+CONVERTER="kmeans_convert.out"
 
 # Compile the C program
-gcc -ansi -Wall -Wextra -Werror -pedantic-errors -o $EXECUTABLE $PROGRAM_PATH -lm
+gcc -ansi -Wall -Wextra -Werror -pedantic-errors -pthread -o $EXECUTABLE $PROGRAM_PATH -lm
+if [ $? -ne 0 ]; then
+    echo "Compilation failed."
+    exit 1
+fi
+gcc -ansi -Wall -Wextra -Werror -pedantic-errors -o $CONVERTER $CONVERTER_PATH
 if [ $? -ne 0 ]; then
     echo "Compilation failed."
     exit 1
@@ -18,9 +26,24 @@ declare -a ks=(3 7 15)
 declare -a ns=(800 430 5000)
 declare -a ds=(3 11 5)
 declare -a max_iters=(600 0 300)
+# every algorithm must reproduce the expected output exactly
+declare -a algorithms=("lloyd" "elkan" "hamerly" "yinyang" "kdtree")
+# every input is also run after conversion to the binary format
+declare -a formats=("csv" "binary")
+# options that must not change the output either, each run with the default algorithm on both formats
+declare -a options=("--threads=4" "--deterministic" "--deterministic --threads=3" "--algorithm=gemm" "--layout=blocked"
+                    "--incremental" "--float32" "--stream" "--n-init=3")
+# thread counts whose --deterministic runs must print the same bytes as --threads=1
+declare -a thread_counts=(2 3 8)
+
+# Runs the executable on input $1 in format $4 for test case $2 with the extra arguments $3
+# and compares its output to the expected output of that test case.
+run_test() {
+    INPUT_FILE="$1"
+    index="$2"
+    EXTRA_ARGS="$3"
+    FORMAT="$4"
 
-for index in "${!inputs[@]}"; do
-    INPUT_FILE="./tests/${inputs[$index]}"
     EXPECTED_OUTPUT_FILE="./tests/${outputs[$index]}"
     K="${ks[$index]}"
     N="${ns[$index]}"
@@ -28,18 +51,18 @@ for index in "${!inputs[@]}"; do
     MAX_ITER="${max_iters[$index]}"
     ACTUAL_OUTPUT_FILE="actual_output_${index}.txt"
 
-    echo "Running test for $INPUT_FILE and $EXPECTED_OUTPUT_FILE with K=$K and max_iter=${MAX_ITER:-'default'}..."
+    echo "Running test for $INPUT_FILE and $EXPECTED_OUTPUT_FILE with K=$K, max_iter=${MAX_ITER:-'default'}, $EXTRA_ARGS and format=$FORMAT..."
 
    if [ ! -f "$EXPECTED_OUTPUT_FILE" ]; then
         echo -e "\033[1;31mExpected output file $EXPECTED_OUTPUT_FILE does not exist.\033[0m"
         echo -e "\033[1;31m\033[1mTEST FAIL\033[0m"
-        continue # Skip to the next iteration of the loop
+        return # Skip to the next test
     fi
 
     if [ "${MAX_ITER}" -eq 0 ]; then
-        COMMAND="./$EXECUTABLE $K $N $D < $INPUT_FILE"
+        COMMAND="./$EXECUTABLE $K $N $D $EXTRA_ARGS < $INPUT_FILE"
     else
-        COMMAND="./$EXECUTABLE $K $N $D $MAX_ITER < $INPUT_FILE"
+        COMMAND="./$EXECUTABLE $K $N $D $MAX_ITER $EXTRA_ARGS < $INPUT_FILE"
     fi
 
     echo "Executing command: $COMMAND"
@@ -50,7 +73,7 @@ for index in "${!inputs[@]}"; do
         echo -e "\033[1;31mRuntime error (exit status: $EXIT_STATUS).\033[0m"
         echo -e "\033[1;31m\033[1mTEST FAIL\033[0m"
         rm $ACTUAL_OUTPUT_FILE
-        continue # Skip to the next iteration of the loop
+        return # Skip to the next test
     fi
 
     echo "Checking for differences..."
@@ -75,7 +98,58 @@ for index in "${!inputs[@]}"; do
 
     rm $ACTUAL_OUTPUT_FILE
     echo "------------------------------------------------"
+}
+
+# Prints the input of test case $1 in format $2, converting it to the binary format if needed.
+input_file() {
+    if [ "$2" == "binary" ]; then
+        ./$CONVERTER "./tests/${inputs[$1]}" "input_$1.kmb"
+        echo "./input_$1.kmb"
+    else
+        echo "./tests/${inputs[$1]}"
+    fi
+}
+
+for FORMAT in "${formats[@]}"; do
+for ALGORITHM in "${algorithms[@]}"; do
+for index in "${!inputs[@]}"; do
+    run_test "$(input_file $index $FORMAT)" $index "--algorithm=$ALGORITHM" $FORMAT
+done
+done
+done
+
+for FORMAT in "${formats[@]}"; do
+for OPTION in "${options[@]}"; do
+for index in "${!inputs[@]}"; do
+    run_test "$(input_file $index $FORMAT)" $index "$OPTION" $FORMAT
+done
+done
+done
+
+# --deterministic must print the same bytes for any thread count, also with a seeded kmeans++ start
+for ALGORITHM in "${algorithms[@]}"; do
+for index in "${!inputs[@]}"; do
+    ARGS="${ks[$index]} ${ns[$index]} ${ds[$index]} --algorithm=$ALGORITHM --init=kmeans++ --seed=7 --deterministic"
+    echo "Comparing thread counts for ./tests/${inputs[$index]} with $ARGS..."
+    ./$EXECUTABLE $ARGS --threads=1 < "./tests/${inputs[$index]}" > expected_output_$index.txt
+    test_fail=false
+    for THREADS in "${thread_counts[@]}"; do
+        ./$EXECUTABLE $ARGS --threads=$THREADS < "./tests/${inputs[$index]}" > actual_output_$index.txt
+        if [ $? -ne 0 ] || ! cmp -s expected_output_$index.txt actual_output_$index.txt; then
+            test_fail=true
+            echo -e "\033[1;31m--threads=$THREADS differs from --threads=1\033[0m"
+        fi
+    done
+    if $test_fail; then
+        echo -e "\033[1;31m\033[1mTEST FAIL\033[0m"
+    else
+        echo -e "\033[1;32m\033[1mTEST PASS\033[0m"
+    fi
+    rm expected_output_$index.txt actual_output_$index.txt
+    echo "------------------------------------------------"
+done
 done
+rm -f input_*.kmb
 
 # Optional: Remove the executable after the tests are done
-rm $EXECUTABLE
+rm $EXECUTABLE $CONVERTER
@@ -1,4 +1,5 @@
 import sys
+import struct
 import pandas as pd
 import numpy as np
 import mykmeanssp as km
@@ -9,22 +10,45 @@ CLUSTER_MSG = "Invalid number of clusters!"
 ITER_MSG = "Invalid maximum iteration!"
 EPS_MSG = "Invalid epsilon!"
 ERR_MSG = "An Error Has Occurred"
+# binary datasets written by HW1/kmeans_convert --keys. These mirror the BINARY_* defines and the
+# BinaryHeader struct of HW1/kmeans_convert.c and HW1/kmeans.c, change them together
+BINARY_MAGIC = b"KMBINARY"
+BINARY_BYTE_ORDER = 0x01020304
+BINARY_VERSION = 1
+BINARY_HEADER_SIZE = 64
+BINARY_ALIGNMENT = 64
+# BinaryHeader: magic[8], then the int fields byteOrder, version, n, d, elementSize, columnMajor, hasKeys
+BINARY_HEADER_FORMAT = '=8s7i'
+# --init=<method> values: the numpy seeding of init_centroids, or a method of the C module (as --init of HW1)
+INIT_METHODS = ('numpy', 'kmeans++', 'kmeans||', 'afkmc2')
 # End of General Setup #
 
 def main():
-    if len(sys.argv) != 6 and len(sys.argv) != 5:
+    # an optional --init=<method> may come anywhere, the other arguments are positional
+    init = 'numpy'
+    args = []
+    for arg in sys.argv[1:]:
+        if arg.startswith('--init='):
+            init = arg[len('--init='):]
+        else:
+            args.append(arg)
+    if init not in INIT_METHODS:
+        print(ERR_MSG)
+        return 1
+
+    if len(args) != 5 and len(args) != 4:
         print(ERR_MSG)
         return 1
 
     try:
-        k = int(sys.argv[1])
+        k = int(args[0])
     except:
         print(CLUSTER_MSG)
         return 1
 
-    if len(sys.argv) == 6:
+    if len(args) == 5:
         try:
-            iter = int(sys.argv[2])
+            iter = int(args[1])
         except:
             print(ITER_MSG)
             return 1
@@ -35,7 +59,7 @@ def main():
         return 1
 
     try:
-        eps = float(sys.argv[-3])
+        eps = float(args[-3])
     except:
         print(EPS_MSG)
         return 1
@@ -43,13 +67,13 @@ def main():
         print(EPS_MSG)
         return 1
 
-    path1 = sys.argv[-2]
-    path2 = sys.argv[-1]  # no input checks for file paths
+    path1 = args[-2]
+    path2 = args[-1]  # no input checks for file paths
 
-    kmeans_pp(k, iter, eps, path1, path2)
+    kmeans_pp(k, iter, eps, path1, path2, init)
 
 
-def kmeans_pp(k: int, iter: int, eps: float, path1: str, path2: str):
+def kmeans_pp(k: int, iter: int, eps: float, path1: str, path2: str, init: str = 'numpy'):
     """
     Executes entirety of kmeans++ algorithm on defined inputs,
     including calling C module for kmeans algorithm.
@@ -60,10 +84,12 @@ def kmeans_pp(k: int, iter: int, eps: float, path1: str, path2: str):
     :param eps: epsilon for convergence condition.
     :param path1: path of first file.
     :param path2: path of second file.
+    :param init: 'numpy' for init_centroids, else the method of init_centroids_native
+    ('kmeans++', 'kmeans||' or 'afkmc2').
     :return: None
     """
-    data_1, col_count_1 = get_data_from_csv(path1)
-    data_2, col_count_2 = get_data_from_csv(path2)
+    data_1, col_count_1 = get_data(path1)
+    data_2, col_count_2 = get_data(path2)
     d = col_count_1 + col_count_2 - 2
 
     data = pd.merge(data_1, data_2, on='0', how='inner')
@@ -78,19 +104,21 @@ def kmeans_pp(k: int, iter: int, eps: float, path1: str, path2: str):
     if k < 2 or k > len(data_array_with_keys):
         print(CLUSTER_MSG)
         return
-    # split into data and keys arrays
-    data_array = data_array_with_keys[:, 1:]
+    # split into data and keys arrays, the data contiguous so the C module reads it in place
+    data_array = np.ascontiguousarray(data_array_with_keys[:, 1:], dtype=np.float64)
     keys_array = data_array_with_keys[:, :1].flatten()
 
-    ini_centroids, choices = init_centroids(data_array, k)
+    if init == 'numpy':
+        ini_centroids, choices = init_centroids(data_array, k)
+    else:
+        ini_centroids, choices = init_centroids_native(data_array, k, method=init)
 
     # extract keys of data points chosen as centroids
     chosen_keys = [keys_array[ind] for ind in choices]
 
     # execute kmeans algorithm using initial centroids
     try:
-        result = km.fit(k, len(data_array), d, iter, eps,
-                    ini_centroids.flatten().tolist(), data_array.flatten().tolist())
+        result = km.fit(k, len(data_array), d, iter, eps, ini_centroids, data_array)
     except Exception as e:
         print(ERR_MSG)
         return
@@ -104,6 +132,51 @@ def kmeans_pp(k: int, iter: int, eps: float, path1: str, path2: str):
     print_centroids(result, k, d)
 
 
+def get_data(path: str):  # might throw file exceptions
+    """
+    Fetches data from a binary dataset or from a csv file, whichever path holds.
+
+    :param path: path of the data file.
+    :return: the pd.DataFrame, the amount of columns
+    """
+    with open(path, 'rb') as f:
+        magic = f.read(len(BINARY_MAGIC))
+    if magic == BINARY_MAGIC:
+        return get_data_from_binary(path)
+    return get_data_from_csv(path)
+
+
+def get_data_from_binary(path: str):
+    """
+    Maps a binary dataset with a key column and returns a data frame
+    shaped like the one of get_data_from_csv, keys first.
+
+    :param path: path of binary file.
+    :return: the pd.DataFrame, the amount of columns
+    """
+    with open(path, 'rb') as f:
+        header = f.read(BINARY_HEADER_SIZE)
+        f.seek(0, 2)
+        size = f.tell()
+    if len(header) < BINARY_HEADER_SIZE:
+        raise ValueError("unsupported binary dataset")
+    magic, byte_order, version, n, d, element_size, column_major, has_keys = struct.unpack_from(BINARY_HEADER_FORMAT, header)
+    payload_offset = BINARY_HEADER_SIZE + (n * 8 + BINARY_ALIGNMENT - 1) // BINARY_ALIGNMENT * BINARY_ALIGNMENT
+    # the checks of the C loader (a byte order written on another machine reads back swapped)
+    if (magic != BINARY_MAGIC or byte_order != BINARY_BYTE_ORDER or version != BINARY_VERSION or not has_keys
+            or n < 1 or d < 1 or element_size not in (8, 4) or size < payload_offset + n * d * element_size):
+        raise ValueError("unsupported binary dataset")
+
+    keys = np.memmap(path, dtype=np.float64, mode='r', offset=BINARY_HEADER_SIZE, shape=(n,))
+    payload = np.memmap(path, dtype=np.float64 if element_size == 8 else np.float32, mode='r',
+                        offset=payload_offset, shape=(d, n) if column_major else (n, d))
+    if column_major:
+        payload = payload.T
+
+    col_inds = [str(i) for i in range(d + 1)]
+    return pd.DataFrame(np.column_stack((keys, payload)), columns=col_inds), d + 1
+
+
 def get_data_from_csv(path: str):  # might throw file exceptions
     """
     Fetches data from csv file and returns a data frame containing it
@@ -151,6 +224,24 @@ def init_centroids(data_points: np.ndarray, k: int):
     return centroids, choices
 
 
+def init_centroids_native(data_points: np.ndarray, k: int, method: str = 'kmeans++'):
+    """
+    Initializes centroids according to kmeans++ algorithm in the C module,
+    which keeps D(x) up to date against only the newest centroid.
+    The C sampler is seeded from np.random, so results follow np.random.seed.
+
+    :param data_points: a np.ndarray containing the data points.
+    :param k: the amount of clusters.
+    :param method: 'kmeans++', 'kmeans||' for a few oversampling passes instead of k,
+    or 'afkmc2' for a single pass followed by a Markov chain per centroid.
+    :return: a np.ndarray of dimensions (k, d) containing the initial centroids,
+    a np.ndarray of dimensions (k,) containing indices of chosen datapoints
+    """
+    n, d = data_points.shape
+    centroids, choices = km.kmeans_pp(k, n, d, np.ascontiguousarray(data_points), seed=np.random.randint(2 ** 31), method=method)
+    return np.array(centroids).reshape(k, d), np.array(choices, dtype=int)
+
+
 def compute_d_x(data_points: np.ndarray, centroids: np.ndarray):
     """
     Computes D(x) array from data points array and array of centroids chosen so far.
@@ -179,10 +270,11 @@ def prob_dist(d_x: np.ndarray):
 
 def print_centroids(centroids, k: int, d: int):
     """
-    Print final result of kmeans algorithm, e.g. the resulting centroids.
+    Print final result of kmeans algorithm, e.g. the resulting centroids,
+    rounded to 4 decimal places.
     :param k: number of centroids.
     :param d: number of dimensions.
-    :param centroids: list of centroid coordinates.
+    :param centroids: the k * d centroid coordinates in full precision.
     :return: None
     """
     for i in range(k):
@@ -1,7 +1,487 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/* assignment algorithms*/
+#define ALGORITHM_LLOYD 0
+#define ALGORITHM_ELKAN 1
+#define ALGORITHM_HAMERLY 2
+#define ALGORITHM_ACCELERATED 3 /* Elkan for k <= ELKAN_MAX_K, Hamerly above it*/
+#define ALGORITHM_YINYANG 4
+#define ALGORITHM_GEMM 5
+#define ALGORITHM_KDTREE 6
+
+/* largest k for which the accelerated mode keeps Elkan's k lower bounds per point*/
+#define ELKAN_MAX_K 32
+
+/* Yinyang keeps one lower bound per group of about this many centroids*/
+#define YINYANG_GROUP_SIZE 10
+/* Lloyd rounds used to group the initial centroids for Yinyang*/
+#define YINYANG_GROUPING_ROUNDS 5
+
+/* GEMM backend: microkernel of GEMM_MR points x GEMM_NR centroids, blocks of points, centroids and coordinates*/
+#define GEMM_MR 4
+#define GEMM_NR 8
+#define GEMM_POINT_BLOCK 64     /* multiple of GEMM_MR*/
+#define GEMM_CENTROID_BLOCK 256 /* multiple of GEMM_NR*/
+#define GEMM_DEPTH_BLOCK 256
+
+/* most points in a leaf of the kd-tree of the filtering algorithm*/
+#define KDTREE_LEAF_SIZE 16
+/* bound on the depth of that tree, whose median splits give about log2(n) levels*/
+#define KDTREE_MAX_DEPTH 40
+
+/* bytes per cache line, per-thread accumulators are padded to it to avoid false sharing*/
+#define CACHE_LINE 64
+/* huge page size on x86-64, mappings for huge pages are rounded up to it*/
+#define HUGE_PAGE_SIZE 2097152
+/* fitArena is kept between fits up to this many bytes, and while it is at most FIT_ARENA_SLACK times the last fit's*/
+#define FIT_ARENA_KEEP_MAX (64UL << 20)
+#define FIT_ARENA_SLACK 4
+
+/* fixed number of point chunks reduced in a fixed tree order by the deterministic mode*/
+#define DETERMINISTIC_CHUNKS 64
+
+/* restarts running at once, every one in its own workspace. Further restarts wait for a free one*/
+#define RESTART_MAX_WORKERS 16
+
+#define INIT_FIRST 0           /* the first k points*/
+#define INIT_KMEANS_PP 1       /* k-means++*/
+#define INIT_KMEANS_PARALLEL 2 /* k-means||*/
+#define INIT_AFKMC2 3          /* AFK-MC2, Markov chain approximation of k-means++*/
+/* k-means|| oversampling rounds before the candidates are reclustered*/
+#define KMEANS_PARALLEL_ROUNDS 5
+/* k-means|| points sampled per round, in multiples of k*/
+#define KMEANS_PARALLEL_OVERSAMPLING 2
+/* k-means|| new candidates compared per pass over the points, signals are checked between passes*/
+#define KMEANS_PARALLEL_SLICE 64
+/* AFK-MC2 proposals per centroid*/
+#define AFKMC2_CHAIN_LENGTH 200
+
+/* seconds between two checks for Python signals while a fit runs without the GIL*/
+#define SIGNAL_CHECK_INTERVAL 0.1
+
+/* points per block of the blocked layout, one AVX-512 vector of doubles*/
+#define POINT_BLOCK_LANES 8
+
+/* largest dimension with kernels unrolled for it (see FIXED_DIM_KERNELS), all used without SIMD kernels*/
+#define FIXED_DIM_MAX 32
+/* largest dimension where the unrolled kernels beat optimized SIMD kernels (measured with AVX-512)*/
+#define FIXED_DIM_SIMD_MAX 5
+/* centroids whose distances computeClusterSumsFixedD sums side by side (the size of its quad)*/
+#define FIXED_DIM_CENTROIDS 4
+/* UNROLL_D(X) expands to X(0) X(1) ... X(D - 1)*/
+#define UNROLL_1(X) X(0)
+#define UNROLL_2(X) UNROLL_1(X) X(1)
+#define UNROLL_3(X) UNROLL_2(X) X(2)
+#define UNROLL_4(X) UNROLL_3(X) X(3)
+#define UNROLL_5(X) UNROLL_4(X) X(4)
+#define UNROLL_6(X) UNROLL_5(X) X(5)
+#define UNROLL_7(X) UNROLL_6(X) X(6)
+#define UNROLL_8(X) UNROLL_7(X) X(7)
+#define UNROLL_9(X) UNROLL_8(X) X(8)
+#define UNROLL_10(X) UNROLL_9(X) X(9)
+#define UNROLL_11(X) UNROLL_10(X) X(10)
+#define UNROLL_12(X) UNROLL_11(X) X(11)
+#define UNROLL_13(X) UNROLL_12(X) X(12)
+#define UNROLL_14(X) UNROLL_13(X) X(13)
+#define UNROLL_15(X) UNROLL_14(X) X(14)
+#define UNROLL_16(X) UNROLL_15(X) X(15)
+#define UNROLL_17(X) UNROLL_16(X) X(16)
+#define UNROLL_18(X) UNROLL_17(X) X(17)
+#define UNROLL_19(X) UNROLL_18(X) X(18)
+#define UNROLL_20(X) UNROLL_19(X) X(19)
+#define UNROLL_21(X) UNROLL_20(X) X(20)
+#define UNROLL_22(X) UNROLL_21(X) X(21)
+#define UNROLL_23(X) UNROLL_22(X) X(22)
+#define UNROLL_24(X) UNROLL_23(X) X(23)
+#define UNROLL_25(X) UNROLL_24(X) X(24)
+#define UNROLL_26(X) UNROLL_25(X) X(25)
+#define UNROLL_27(X) UNROLL_26(X) X(26)
+#define UNROLL_28(X) UNROLL_27(X) X(27)
+#define UNROLL_29(X) UNROLL_28(X) X(28)
+#define UNROLL_30(X) UNROLL_29(X) X(29)
+#define UNROLL_31(X) UNROLL_30(X) X(30)
+#define UNROLL_32(X) UNROLL_31(X) X(31)
+
+typedef struct ThreadPool ThreadPool;
+
+/*
+ * A worker thread of a ThreadPool and the index it passes to tasks.
+ */
+typedef struct
+{
+    ThreadPool *pool;
+    int index;
+    pthread_t thread;
+} ThreadPoolWorker;
+
+/*
+ * Threads that stay alive between iterations and run one task at a time.
+ * The thread calling runOnThreadPool takes part as thread 0.
+ */
+struct ThreadPool
+{
+    int threadCount;           /* including the calling thread*/
+    ThreadPoolWorker *workers; /* threadCount - 1 workers*/
+    pthread_mutex_t lock;
+    pthread_cond_t workReady;
+    pthread_cond_t workDone;
+    void (*task)(void *taskArg, int threadIndex);
+    void *taskArg;
+    int generation; /* incremented for every task, workers wait for it to change*/
+    int pending;    /* workers that did not finish the current task*/
+    int stopping;
+};
+
+/*
+ * Workspace of a run. Every buffer is carved out of one mapping, aligned to CACHE_LINE,
+ * after a first pass has counted how many bytes all of them need.
+ */
+typedef struct
+{
+    char *base;    /* the mapping, NULL while nothing is mapped*/
+    size_t size;   /* bytes mapped at base*/
+    size_t used;   /* bytes handed out or counted so far, a multiple of CACHE_LINE*/
+    int sizing;    /* true iff arenaAlloc only counts bytes*/
+    int hugePages; /* true iff the mapping was made for huge pages*/
+} Arena;
+
+/*
+ * Node of the kd-tree of the filtering algorithm, covering positions first to last - 1 of kdOrder.
+ */
+typedef struct
+{
+    int first;
+    int last;
+    int left;  /* index of the child node covering the lower half, -1 for leaves*/
+    int right; /* index of the child node covering the upper half, -1 for leaves*/
+} KdNode;
+
+/*
+ * Per run state kept between iterations by the assignment step.
+ * Bound arrays are only allocated for the algorithms that use them.
+ */
+typedef struct
+{
+    int algorithm;          /* one of the ALGORITHM_* values, never ALGORITHM_ACCELERATED*/
+    int boundsReady;        /* false until the first full assignment has set the bounds*/
+    int *labels;            /* index of the centroid each point is assigned to, kept by every algorithm when options->keepLabels*/
+    double *upperBounds;    /* upper bound on the distance from each point to its centroid*/
+    double *lowerBounds;    /* Elkan: n * k lower bounds, Hamerly: one bound on the second closest centroid,
+                               Yinyang: n * groupCount bounds*/
+    double *centroidDeltas; /* distance each centroid moved in the last update*/
+    double *halfCentroidDists; /* Elkan: k * k matrix of half distances between centroids*/
+    double *halfMinDists;   /* half distance from each centroid to the closest other centroid*/
+    int groupCount;         /* Yinyang: number of centroid groups*/
+    int *centroidGroups;    /* Yinyang: group of every centroid*/
+    int *groupMembers;      /* Yinyang: centroids listed group after group*/
+    int *groupStarts;       /* Yinyang: where each group starts in groupMembers, groupCount + 1 entries*/
+    double *groupDeltas;    /* Yinyang: largest movement of a centroid in each group*/
+    double *oldGroupBounds; /* Yinyang: scratch copy of the bounds of the current point, one per thread*/
+    double maxDelta;        /* Hamerly: largest centroid movement*/
+    double secondDelta;     /* Hamerly: largest movement among the other centroids*/
+    int maxDeltaCentroid;   /* Hamerly: centroid that moved the most*/
+    double *pointNorms;     /* GEMM: squared norm of every point*/
+    double *centroidNorms;  /* GEMM: squared norm of every centroid*/
+    double *packedCentroids; /* GEMM: centroids in panels of GEMM_NR, coordinate after coordinate*/
+    double *gemmDots;       /* GEMM: per thread block of dot products followed by GEMM_POINT_BLOCK best distances*/
+    int *gemmClosest;       /* GEMM: per thread closest centroids of a block of points*/
+    KdNode *kdNodes;        /* kd-tree: nodes of the tree over the points, the root first*/
+    int kdNodeCount;        /* kd-tree: nodes in use*/
+    int *kdOrder;           /* kd-tree: point indices, every node covers a contiguous range of them*/
+    double *kdCells;        /* kd-tree: bounding box of every node, d minimums then d maximums*/
+    double *kdSums;         /* kd-tree: sum of the points of every node*/
+    int *kdCandidates;      /* kd-tree: per thread candidate lists, KDTREE_MAX_DEPTH + 2 lists of k*/
+    double *kdMidpoints;    /* kd-tree: per thread cell midpoint of d doubles*/
+    float *singlePoints;    /* single precision: the points, used instead of dataPoints. Set by the caller*/
+    float *singleCentroids; /* single precision: the centroids rounded to float before every assignment*/
+    double *blockedPoints;  /* blocked layout: the points packed by packPointBlocks*/
+    int *countedLabels;     /* incremental: cluster each point is counted in by incrementalSums, -1 before the first assignment*/
+    double *incrementalSums; /* incremental: cluster sums kept between iterations*/
+    int *incrementalQtys;   /* incremental: cluster sizes kept between iterations*/
+    int movedPoints;        /* incremental: points whose cluster changed in the last assignment, -1 when not counted*/
+    int threadCount;        /* threads sharing the assignment step*/
+    ThreadPool *pool;       /* ownPool, or the threads of options->pool*/
+    ThreadPool ownPool;     /* started only when threadCount > 1 and options->pool is NULL*/
+    int deterministic;      /* true iff results must not depend on threadCount*/
+    int chunkCount;         /* deterministic: number of chunks of points*/
+    char *accumulators;     /* private clusterSums and clusterQtys of every thread, or of every chunk*/
+    size_t accumulatorStride; /* bytes between consecutive accumulators*/
+} KMeansState;
+
+/*
+ * Arguments of assignTask, shared by all threads of one assignment step.
+ */
+typedef struct
+{
+    double *dataPoints;
+    double *centroids;
+    int k;
+    int n;
+    int d;
+    KMeansState *state;
+} AssignJob;
+
+/*
+ * Arguments of seedTask, shared by all threads of one k-means++ distance update.
+ */
+typedef struct
+{
+    double *dataPoints; /* exactly one of dataPoints and singlePoints is not NULL*/
+    float *singlePoints;
+    double *centroid;   /* the centroid picked last*/
+    double *minDists;   /* squared distance from every point to the closest centroid picked so far*/
+    double chunkSums[DETERMINISTIC_CHUNKS]; /* sum of minDists over every chunk of points*/
+    int chunkCount;
+    int threadCount;
+    int firstCentroid;  /* true iff centroid is the first one, so minDists are not set yet*/
+    double *weights;    /* weight of every point, NULL for all 1*/
+    int n;
+    int d;
+} SeedJob;
+
+/*
+ * Scratch buffers of seedKMeansParallel, laid out by layoutParallelSeeding.
+ */
+typedef struct
+{
+    double *minDists;       /* squared distance from every point to the closest candidate*/
+    int *closest;           /* closest candidate of every point*/
+    unsigned char *sampled; /* true for every point sampled in some round*/
+    int *candidateIndices;  /* the point every candidate is*/
+    double *candidates;     /* coordinates of the candidates*/
+    double *weights;        /* points closest to every candidate*/
+    double *candidateDists; /* distances of the weighted k-means++ over the candidates*/
+    int *candidateChoices;  /* candidates picked by the weighted k-means++*/
+    int capacity;           /* candidates the buffers hold*/
+} ParallelSeeding;
+
+/*
+ * Arguments of parallelSampleTask and parallelUpdateTask, shared by all threads of one k-means|| round.
+ */
+typedef struct
+{
+    double *dataPoints; /* exactly one of dataPoints and singlePoints is not NULL*/
+    float *singlePoints;
+    ParallelSeeding *seeding;
+    int firstCandidate; /* candidates from firstCandidate on were added in the last round*/
+    int candidateCount;
+    double oversampling; /* points expected to be sampled per round*/
+    double cost;        /* sum of minDists*/
+    unsigned long seed;
+    int round;
+    double chunkSums[DETERMINISTIC_CHUNKS]; /* sum of minDists over every chunk of points*/
+    int chunkCount;
+    int threadCount;
+    int n;
+    int d;
+} ParallelSeedJob;
+
+/*
+ * Python signals of a fit running without the GIL, shared by the threads of its restarts.
+ */
+typedef struct
+{
+    pthread_t caller;     /* thread that called fit, the only one that takes the GIL back*/
+    double nextCheck;     /* monotonic time of the next check, only used by caller*/
+    int interrupted;      /* true once a signal handler raised, its exception is set on caller*/
+    pthread_mutex_t lock; /* guards interrupted*/
+} FitSignals;
+
+/*
+ * Run options given to fit as keyword arguments.
+ */
+typedef struct
+{
+    int algorithm;   /* one of the ALGORITHM_* values*/
+    int threadCount;   /* threads used by the assignment step*/
+    int deterministic; /* true iff results must be identical for any threadCount*/
+    int batchSize;     /* points per mini-batch, 0 for full passes over all points*/
+    unsigned long seed; /* seed of the mini-batch sampler and of the random initial centroids of restarts 1 to restarts - 1*/
+    int singlePrecision; /* true iff points and centroids are compared in float, the sums stay double*/
+    int blockedLayout;   /* true iff Lloyd runs on points packed in blocks (see packPointBlocks)*/
+    int incremental;     /* true iff cluster sums are kept between iterations and only moved points update them*/
+    int hugePages;       /* true iff the workspace arena asks for huge pages*/
+    int restarts;        /* independent fits from different initial centroids, the one with the lowest inertia is kept*/
+    int keepLabels;      /* true iff every assignment step stores the centroid of every point in state->labels*/
+    int keepEmptyClusters; /* true iff a centroid no point is assigned to stays where it is instead of becoming NaN*/
+    ThreadPool *pool;    /* started threads the assignment step runs on, NULL for threads of its own*/
+    FitSignals *signals; /* checked between iterations, NULL if the fit holds the GIL*/
+} KMeansOptions;
+
+/*
+ * Report of a fit with full output. The inertia of an assignment step is summed over the points and the
+ * labels it stored, one pass over the points per iteration. Deriving it from the cluster sums instead
+ * cancels away all digits when the clusters are far apart relative to their spread.
+ */
+typedef struct
+{
+    double *inertias; /* inertia of every assignment step against the centroids it compared with, NULL without full output*/
+    double *shifts;   /* largest centroid movement in the update after every assignment step, 0 if none followed*/
+    int iterations;   /* assignment steps run*/
+} FitTrace;
+
+/*
+ * Buffers of a fit, all laid out in one arena by setupWorkspace.
+ */
+typedef struct
+{
+    double *dataPoints;     /* the points, NULL unless they are copied as doubles*/
+    float *singlePoints;    /* the points, NULL unless they are copied in single precision*/
+    double *centroids;
+    double *clusterSums;    /* sum of data points in each cluster*/
+    int *clusterQtys;       /* quantity of data points in each cluster*/
+    double *batch;          /* mini-batch: the sampled points*/
+    long *centroidCounts;   /* mini-batch: points assigned to every centroid so far*/
+    double *initialCentroids; /* restarts: k initial centroids for every restart, only in the first workspace*/
+    double *bestCentroids;  /* restarts: centroids of the fit with the lowest inertia so far, only in the first workspace*/
+    FitTrace trace;         /* full output: report of the last fit run in this workspace*/
+    FitTrace bestTrace;     /* full output with restarts: report of the fit of bestCentroids, only in the first workspace*/
+    int *bestLabels;        /* full output with restarts: labels of that fit, only in the first workspace*/
+    KMeansOptions stateOptions; /* options state was set up with*/
+    KMeansState state;
+} Workspace;
+
+/*
+ * Arguments of restartTask, shared by all workers of runRestarts.
+ */
+typedef struct
+{
+    double *dataPoints; /* shared by all restarts, exactly one of dataPoints and singlePoints is not NULL*/
+    float *singlePoints;
+    int k;
+    int n;
+    int d;
+    int iter;
+    double epsilon;
+    KMeansOptions *options;
+    Workspace *workspaces; /* one per worker, the first one also holds initialCentroids and bestCentroids*/
+    int workerCount;
+    double bestInertia;
+    int bestRestart;       /* restart bestCentroids come from, -1 until one finished*/
+    pthread_mutex_t lock;  /* guards bestInertia, bestRestart and bestCentroids*/
+} RestartJob;
+
+/*
+ * A workspace of a mykmeanssp.KMeans object in its own arena, only laid out again when a call needs more points.
+ */
+typedef struct
+{
+    Arena arena;
+    Workspace ws;
+    int capacity;     /* points ws is laid out for, 0 while it is not set up*/
+    int copiesPoints; /* true iff ws holds a buffer for points that are not read in place*/
+} ModelLayout;
+
+/*
+ * A mykmeanssp.KMeans object: k centroids of d values kept between calls, a workspace for fit and one for
+ * the other calls, and the threads all of them run on.
+ */
+typedef struct
+{
+    PyObject_HEAD
+    int k;
+    int d;
+    int iter;
+    double epsilon;
+    KMeansOptions options;   /* algorithm, threads and determinism of every call*/
+    double *centroids;       /* k * d values, owned by the model*/
+    long *centroidCounts;    /* points every centroid was fitted to so far*/
+    int fitted;              /* true once centroids hold centroids*/
+    double inertia;          /* of the last assignment step of the last fit*/
+    int iterations;          /* assignment steps of the last fit*/
+    ModelLayout fitLayout;   /* fit: the algorithm of options over all points*/
+    ModelLayout batchLayout; /* partial_fit, predict and transform: Lloyd or GEMM over the points given*/
+    ThreadPool pool;         /* threads of both layouts, started once when options.threadCount > 1*/
+    pthread_mutex_t lock;    /* held by the call using the model, see lockModel*/
+} KMeansModel;
+
+/*
+ * Arguments of transformTask, shared by all threads of one transform call.
+ */
+typedef struct
+{
+    double *dataPoints;
+    double *centroids;
+    double *distances;  /* n * k distances from every point to every centroid*/
+    int k;
+    int n;
+    int d;
+    KMeansState *state; /* batch state of the model, prepared for dataPoints and centroids*/
+} TransformJob;
 
 double eucDist(double *vec1, double *vec2, int d);
+/*
+ * Calculates squared Euclidean distance between two vectors with plain C loops.
+ * Assumes both vectors are of dimension d.
+ */
+double sqDistScalar(double *vec1, double *vec2, int d);
+#ifdef HAVE_X86_KERNELS
+/*
+ * SSE2, AVX2 and AVX-512 variants of sqDistScalar.
+ * Only call a variant the running CPU supports (see selectDistanceKernel).
+ */
+double sqDistSse2(double *vec1, double *vec2, int d);
+double sqDistAvx2(double *vec1, double *vec2, int d);
+double sqDistAvx512(double *vec1, double *vec2, int d);
+#endif
+/*
+ * GEMM microkernel: adds to dots[r * dotsStride + c] the dot product of rows[r] and
+ * centroid c of a packed panel over coordinates depthFirst to depthLast - 1,
+ * for GEMM_MR rows and GEMM_NR centroids.
+ */
+void gemmKernelScalar(double **rows, double *panel, int depthFirst, int depthLast, double *dots, int dotsStride);
+#ifdef HAVE_X86_KERNELS
+/*
+ * AVX2 and FMA variant of gemmKernelScalar.
+ */
+void gemmKernelAvx2(double **rows, double *panel, int depthFirst, int depthLast, double *dots, int dotsStride);
+#endif
+/*
+ * Finds the closest of the k centroids to each of the POINT_BLOCK_LANES points of a block
+ * packed by packPointBlocks, comparing one centroid against the whole block at a time.
+ * Every distance is summed in the order of sqDistScalar and ties go to the lower index,
+ * so the labels are those of updateClusters with the scalar kernel.
+ */
+void blockAssignScalar(double *block, double *centroids, int k, int d, int *closest);
+#ifdef HAVE_X86_KERNELS
+/*
+ * SSE2, AVX2 and AVX-512 variants of blockAssignScalar.
+ * Only call a variant the running CPU supports (see selectDistanceKernel).
+ */
+void blockAssignSse2(double *block, double *centroids, int k, int d, int *closest);
+void blockAssignAvx2(double *block, double *centroids, int k, int d, int *closest);
+void blockAssignAvx512(double *block, double *centroids, int k, int d, int *closest);
+#endif
+/*
+ * Single precision variant of sqDistScalar, summed in float.
+ */
+float sqDistSingleScalar(float *vec1, float *vec2, int d);
+#ifdef HAVE_X86_KERNELS
+/*
+ * SSE, AVX2 and AVX-512 variants of sqDistSingleScalar.
+ * Only call a variant the running CPU supports (see selectDistanceKernel).
+ */
+float sqDistSingleSse(float *vec1, float *vec2, int d);
+float sqDistSingleAvx2(float *vec1, float *vec2, int d);
+float sqDistSingleAvx512(float *vec1, float *vec2, int d);
+#endif
+/*
+ * Points sqDist to the widest squared distance kernel supported by the CPU,
+ * and gemmKernel to the matching GEMM microkernel. Sets fixedDimLimit.
+ * Called once when the module is imported.
+ */
+void selectDistanceKernel(void);
 /*
  * Evaluates loop convergence condition using global variable
  * epsilon.
@@ -12,290 +492,5055 @@ short converge(double *deltaArray);
 /*
  * Initializes centroids to first k elements.
  */
-int updateCentroids(double *centroids, double *clusterSums, int *clusterQtys, int k, int d, double epsilon);
+int updateCentroids(double *centroids, double *clusterSums, int *clusterQtys, int k, int d, double epsilon, double *centroidDeltas);
 /*
  * updates a single centroid. returns true iff convergence condition is true for current centroid.
+ * Stores the distance the centroid moved in delta.
  */
-int updateCentroid(double *centroid, double *clusterSum, int clusterQty, int d, double epsilon);
+int updateCentroid(double *centroid, double *clusterSum, int clusterQty, int d, double epsilon, double *delta);
 /*
  * Makes all values of clusterSums and clusterQtys 0.
  */
 void clearClusters(double *clusterSums, int *clusterQtys, int k, int d);
 /*
  * Updates clusterSums and clusterQtys in accordance with inserting vec to the nearest
- * cluster.
+ * cluster. Returns the index of that cluster.
  */
-void updateClusters(double *vec, double *centroids, double *clusterSums, int *clusterQtys, int k, int d);
+int updateClusters(double *vec, double *centroids, double *clusterSums, int *clusterQtys, int k, int d);
 /*
  * Computes new cluster sums and new cluster sizes
  * and puts them in clusterSums and clusterQtys respectively.
+ * When labels is not NULL, also stores the closest centroid of every point there.
  */
-void computeClusterSums(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int n, int d);
+void computeClusterSums(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int n, int d, int *labels);
 /*
- * Returns the updated centroids.
+ * Variants of sqDistScalar and computeClusterSums unrolled for every dimension up to
+ * FIXED_DIM_MAX, indexed by dimension (see FIXED_DIM_KERNELS).
  */
-int fit(int k, int n, int d, int iter, double epsilon, double *initialCentroids, double *dataPoint);
+extern double (*fixedDimSqDist[FIXED_DIM_MAX + 1])(double *vec1, double *vec2, int d);
+extern void (*fixedDimClusterSums[FIXED_DIM_MAX + 1])(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int n, int d, int *labels);
+/*
+ * Returns the ALGORITHM_* value named by name, or -1 for an unknown name.
+ */
+int algorithmFromName(char *name);
+/*
+ * Lays out in arena the arrays the algorithm chosen in options needs in state.
+ * While arena is sizing only their bytes are counted, else they are initialized
+ * and the threads of state are started.
+ * Resolves ALGORITHM_ACCELERATED to Elkan or Hamerly according to k.
+ * Returns 0 on success and else 1.
+ */
+int initKMeansState(KMeansState *state, KMeansOptions *options, int k, int n, int d, Arena *arena);
+/*
+ * Stops the threads of state. Its arrays are freed with the arena they were laid out in.
+ */
+void freeKMeansState(KMeansState *state);
+/*
+ * Forgets what state learned about the centroids of the previous fit, so that a new fit on the
+ * same n points can start. What only depends on the points (kd-tree, packed blocks, GEMM norms) is kept.
+ */
+void restartKMeansState(KMeansState *state, int k, int n, int d);
+/*
+ * Makes arena empty, with nothing mapped.
+ */
+void arenaInit(Arena *arena);
+/*
+ * Starts a sizing pass, in which arenaAlloc only counts bytes.
+ */
+void arenaStartSizing(Arena *arena);
+/*
+ * Returns the next size bytes of arena, starting at a multiple of CACHE_LINE.
+ * Returns NULL while sizing.
+ */
+void *arenaAlloc(Arena *arena, size_t size);
+/*
+ * arenaAlloc with the bytes set to 0.
+ */
+void *arenaAllocZeroed(Arena *arena, size_t size);
+/*
+ * Ends the sizing pass by mapping all bytes counted in it at once, and lets arenaAlloc
+ * hand them out from the start. A mapping that is already large enough is reused.
+ * With hugePages it is backed by reserved huge pages (MAP_HUGETLB) if there are any,
+ * else by transparent huge pages.
+ * Returns 0 on success and 1 if nothing could be mapped.
+ */
+int arenaReserve(Arena *arena, int hugePages);
+/*
+ * Unmaps arena, freeing every buffer laid out in it.
+ */
+void arenaRelease(Arena *arena);
+/*
+ * Main loop of a ThreadPool worker.
+ */
+void *threadPoolWorker(void *arg);
+/*
+ * Starts threadCount - 1 worker threads in pool.
+ * Returns 0 on success and else 1.
+ */
+int startThreadPool(ThreadPool *pool, int threadCount);
+/*
+ * Calls task(taskArg, i) on every thread i of pool and returns once all calls returned.
+ */
+void runOnThreadPool(ThreadPool *pool, void (*task)(void *taskArg, int threadIndex), void *taskArg);
+/*
+ * Stops and joins the worker threads of pool.
+ */
+void stopThreadPool(ThreadPool *pool);
+/*
+ * Runs the assignment step of the algorithm selected in state, filling
+ * clusterSums and clusterQtys. With several threads every thread handles a
+ * contiguous chunk of points into its own accumulators, which are merged at the end.
+ */
+void assignPoints(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int n, int d, KMeansState *state);
+/*
+ * Points sums and qtys to accumulator number index of state.
+ */
+void getAccumulators(KMeansState *state, int index, int k, int d, double **sums, int **qtys);
+/*
+ * Thread pool task of assignPoints. taskArg is an AssignJob.
+ */
+void assignTask(void *taskArg, int threadIndex);
+/*
+ * Thread pool task of the deterministic mode. Every chunk of points is
+ * summed in point order into its own accumulator, whichever thread runs it.
+ */
+void chunkedAssignTask(void *taskArg, int threadIndex);
+/*
+ * Adds the chunk accumulators in a fixed pairwise order to clusterSums and clusterQtys,
+ * so the result is bit for bit the same for any thread count.
+ */
+void reduceChunkSums(double *clusterSums, int *clusterQtys, int k, int d, KMeansState *state);
+/*
+ * Assigns points first to last - 1 with the algorithm selected in state
+ * and adds them to clusterSums and clusterQtys.
+ */
+void assignRange(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, KMeansState *state, int threadIndex);
+/*
+ * Per iteration work shared by all points: centroid distances and movement bounds.
+ */
+void prepareAssignment(double *dataPoints, double *centroids, int k, int n, int d, KMeansState *state);
+/*
+ * Adds every point to the sum of the cluster given by labels.
+ */
+void accumulateClusterSums(double *dataPoints, int *labels, double *clusterSums, int *clusterQtys, int n, int d);
+/*
+ * Lloyd's assignment step for the incremental mode. Stores the closest centroid of
+ * points first to last - 1 in labels without adding them to any sum.
+ */
+void computeLabels(double *dataPoints, double *centroids, int *labels, int k, int first, int last, int d);
+/*
+ * Incremental mode: moves every point whose label changed from the sums of its old cluster
+ * to those of its new one, counting them in state->movedPoints, then adds the kept sums
+ * to clusterSums and clusterQtys. Costs O(n) label compares and O(d) per moved point.
+ */
+void applyLabelChanges(double *dataPoints, double *clusterSums, int *clusterQtys, int k, int n, int d, KMeansState *state);
+/*
+ * Fills halfCentroidDists (when allocated) and halfMinDists of state for the current centroids.
+ */
+void computeCentroidDists(double *centroids, int k, int d, KMeansState *state);
+/*
+ * Returns true iff a centroid at distance of at least bound cannot replace closest
+ * as the nearest centroid of a point whose distance to closest is at most upper.
+ * Ties are broken towards the lower index like in updateClusters.
+ */
+int canSkipCentroid(double bound, double upper, int centroid, int closest);
+/*
+ * Elkan's assignment step. Keeps k lower bounds per point and skips every
+ * centroid the triangle inequality rules out. Gives the same labels as updateClusters.
+ */
+void computeClusterSumsElkan(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, KMeansState *state);
+/*
+ * Hamerly's assignment step. Like computeClusterSumsElkan but keeps a single
+ * lower bound per point, so it needs O(n) instead of O(n * k) memory.
+ */
+void computeClusterSumsHamerly(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, KMeansState *state);
+/*
+ * Splits the centroids into state->groupCount groups of nearby centroids
+ * by running a few Lloyd rounds over the centroids themselves.
+ */
+void groupCentroids(double *centroids, int k, int d, KMeansState *state);
+/*
+ * Yinyang assignment step. Keeps one lower bound per group of centroids and
+ * filters whole points, then whole groups, then single centroids.
+ * Needs O(n * k / YINYANG_GROUP_SIZE) memory and gives the same labels as updateClusters.
+ * oldLower is groupCount doubles of scratch owned by the calling thread.
+ */
+void computeClusterSumsYinyang(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, KMeansState *state, double *oldLower);
+/*
+ * Computes the point norms on the first call, then the centroid norms and
+ * packed centroid panels of the current iteration for computeClusterSumsGemm.
+ */
+void prepareGemm(double *dataPoints, double *centroids, int k, int n, int d, KMeansState *state);
+/*
+ * GEMM assignment step. Distances come from ||x||^2 - 2 x . c + ||c||^2 where the
+ * dot products of a block of points and a block of centroids are computed as a
+ * cache blocked matrix product. Rounding differs from updateClusters, so points
+ * almost equally close to two centroids may be assigned differently.
+ * dots and closest are per thread scratch.
+ */
+void computeClusterSumsGemm(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, KMeansState *state, double *dots, int *closest);
+/*
+ * Builds the kd-tree of the filtering algorithm over points 0 to n - 1 into state,
+ * with the bounding box and the sum of the points of every node.
+ */
+void buildKdTree(double *dataPoints, int n, int d, KMeansState *state);
+/*
+ * Builds the subtree over positions first to last - 1 of state->kdOrder, splitting
+ * at the median of the widest coordinate, and returns its node.
+ */
+int buildKdNode(double *dataPoints, int first, int last, int d, KMeansState *state);
+/*
+ * Reorders positions first to last - 1 of order so that position nth holds the point with
+ * the nth smallest coordinate dim, no point before it has a larger one and none after it a smaller one.
+ */
+void selectKdMedian(double *dataPoints, int *order, int first, int last, int nth, int dim, int d);
+/*
+ * Returns true iff no point of cell is closer to centroid candidate than to centroid best.
+ * Tests the corner of cell furthest towards candidate. Ties go to the lower index like in updateClusters.
+ */
+int canPruneKdCandidate(double *centroids, int candidate, int best, double *cell, int d);
+/*
+ * Filtering step of Kanungo et al. on node. Drops the candidates that no point of its cell
+ * is closest to, adds the cached sum of the whole node when a single candidate is left,
+ * and else descends to the children or scans the points of a leaf.
+ * Only positions first to last - 1 of state->kdOrder are assigned.
+ * scratch holds a list of k candidates for every level below node.
+ */
+void filterKdNode(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d,
+                  KMeansState *state, int node, int *candidates, int candidateCount, int *scratch, double *midpoint);
+/*
+ * kd-tree filtering assignment step. Points are visited in the order of the tree, so first
+ * and last are positions in state->kdOrder. Whole subtrees are added from cached sums, so
+ * rounding differs from updateClusters and points almost equally close to two centroids
+ * may be assigned differently.
+ * candidates is (KDTREE_MAX_DEPTH + 2) * k ints and midpoint d doubles of per thread scratch.
+ */
+void computeClusterSumsKdTree(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d,
+                              KMeansState *state, int *candidates, double *midpoint);
+/*
+ * Single precision assignment step. Compares points first to last - 1 with the centroids
+ * in float and adds them to the double clusterSums, so precision is only lost in the
+ * comparison and not in the sums. Stores the closest centroid of every point in labels unless it is NULL.
+ */
+void computeClusterSumsSingle(float *points, float *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, int *labels);
+/*
+ * Copies the first k points into centroids as doubles.
+ */
+void initCentroidsSingle(float *points, double *centroids, int k, int d);
+/*
+ * Copies the points into blocks of POINT_BLOCK_LANES points stored coordinate after
+ * coordinate, so one SIMD instruction handles a coordinate of every point of a block.
+ * The lanes after the last point repeat it.
+ */
+void packPointBlocks(double *dataPoints, double *blockedPoints, int n, int d);
+/*
+ * Lloyd's assignment step on the blocks packed by packPointBlocks (see blockAssignScalar).
+ * Adds points first to last - 1 to clusterSums in their original order.
+ * Stores the closest centroid of every point in labels unless it is NULL.
+ */
+void computeClusterSumsBlocked(double *dataPoints, double *blockedPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, int *labels);
+/*
+ * Returns the next value of a 32 bit xorshift generator and advances rngState.
+ */
+unsigned long nextRandom(unsigned long *rngState);
+/*
+ * Returns a uniform double in [0, 1) with 53 random bits, made of two values of nextRandom.
+ */
+double nextRandomUnit(unsigned long *rngState);
+/*
+ * Returns a nonzero xorshift state scrambled from x, so that nearby values of x give unrelated sequences.
+ */
+unsigned long mixSeed(unsigned long x);
+/*
+ * Returns the squared distance between a single precision point and a double centroid, in double.
+ */
+double sqDistMixed(float *point, double *centroid, int d);
+/*
+ * Returns the squared distance from point i to centroid. Exactly one of dataPoints and singlePoints is not NULL.
+ */
+double pointSqDist(double *dataPoints, float *singlePoints, int i, double *centroid, int d);
+/*
+ * k-means++ seeding: picks k of the n points as centroids, the first one uniformly and every next one
+ * with probability proportional to its squared distance to the closest centroid picked so far.
+ * With weights, both probabilities are also proportional to the weight of the point.
+ * minDists (n doubles) keeps those distances and is only compared against the newest centroid,
+ * so seeding takes O(n * k * d). The picked point indices go to choices unless it is NULL.
+ * The updates run on pool unless it is NULL, over a fixed split of the points in chunks,
+ * so the result only depends on seed and not on the threads.
+ * Stops early once fitInterrupted(signals) after picking a centroid, leaving the rest unset.
+ * Exactly one of dataPoints and singlePoints is not NULL.
+ */
+void seedKMeansPlusPlus(double *dataPoints, float *singlePoints, double *centroids, int *choices, double *minDists, double *weights, int k, int n, int d, unsigned long seed, ThreadPool *pool, FitSignals *signals);
+/*
+ * Returns the INIT_* value named by name, or -1 for an unknown name.
+ */
+int initFromName(char *name);
+/*
+ * Lays out the buffers of seeding in arena for seeding k of n points.
+ */
+void layoutParallelSeeding(ParallelSeeding *seeding, Arena *arena, int k, int n, int d);
+/*
+ * k-means|| seeding: starts from one uniform point, then for KMEANS_PARALLEL_ROUNDS rounds samples every
+ * point independently with probability KMEANS_PARALLEL_OVERSAMPLING * k times its share of the total
+ * squared distance to the candidates so far. Every round is one parallel pass over the points.
+ * The candidates, weighted by the points closest to them, are then reclustered by k-means++.
+ * The picked point indices go to choices unless it is NULL. Like seedKMeansPlusPlus, the result
+ * only depends on seed and not on the threads of pool, which may be NULL. Stops early once
+ * fitInterrupted(signals) after a round.
+ * Exactly one of dataPoints and singlePoints is not NULL.
+ */
+void seedKMeansParallel(double *dataPoints, float *singlePoints, double *centroids, int *choices, ParallelSeeding *seeding, int k, int n, int d, unsigned long seed, ThreadPool *pool, FitSignals *signals);
+/*
+ * AFK-MC2 seeding: picks the first centroid uniformly, then builds the proposal distribution
+ * q(x) = d(x, c1)^2 / (2 * sum of d^2) + 1 / (2n) in one pass over the points. Every next centroid is
+ * the end of a Metropolis-Hastings chain of chainLength proposals drawn from q, accepted with
+ * probability d(y, C)^2 q(x) / (d(x, C)^2 q(y)) against the centroids C picked so far. After the first
+ * pass seeding costs O(chainLength * k^2 * d), independent of n. proposal (n doubles) holds the
+ * running sums of q. The picked point indices go to choices unless it is NULL.
+ * The pass runs on pool unless it is NULL, and the result only depends on seed.
+ * Stops early once fitInterrupted(signals) after picking a centroid.
+ * Exactly one of dataPoints and singlePoints is not NULL.
+ */
+void seedAfkMc2(double *dataPoints, float *singlePoints, double *centroids, int *choices, double *proposal, int k, int n, int d, int chainLength, unsigned long seed, ThreadPool *pool, FitSignals *signals);
+/*
+ * Returns a point drawn from the distribution whose running sums over the n points are proposal.
+ */
+int sampleProposal(double *proposal, int n, unsigned long *rngState);
+/*
+ * Returns the squared distance from point i to the closest of the first count centroids.
+ * Exactly one of dataPoints and singlePoints is not NULL.
+ */
+double closestSqDist(double *dataPoints, float *singlePoints, int i, double *centroids, int count, int d);
+/*
+ * Samples the points of the chunks of thread threadIndex of the ParallelSeedJob taskArg.
+ */
+void parallelSampleTask(void *taskArg, int threadIndex);
+/*
+ * Updates minDists and closest against the newest candidates for the chunks of thread threadIndex of the ParallelSeedJob taskArg.
+ */
+void parallelUpdateTask(void *taskArg, int threadIndex);
+/*
+ * Updates minDists against the newest centroid for the chunks of thread threadIndex of the SeedJob taskArg.
+ */
+void seedTask(void *taskArg, int threadIndex);
+/*
+ * Copies batchSize points drawn uniformly with replacement from dataPoints into batch.
+ */
+void sampleBatch(double *dataPoints, double *batch, int n, int d, int batchSize, unsigned long *rngState);
+/*
+ * Mini-batch centroid update. Every centroid moves towards the mean of its batch points
+ * with a per centroid learning rate of (points in this batch) / (points assigned to it so far),
+ * which keeps each centroid the running mean of all points ever assigned to it.
+ * centroidCounts holds the points assigned so far and is updated.
+ * Stores the distance each centroid moved in centroidDeltas and returns the largest one.
+ * Makes all values of clusterSums and clusterQtys 0 before returning.
+ */
+double updateCentroidsMiniBatch(double *centroids, double *clusterSums, int *clusterQtys, long *centroidCounts, int k, int d, double *centroidDeltas);
+/*
+ * Mini-batch k-means. Runs up to iter steps of assigning a random batch of options->batchSize
+ * points and updating the centroids with updateCentroidsMiniBatch. Stops once an exponentially
+ * weighted average of the largest centroid movement drops below epsilon.
+ * Works on the centroids, batch and state of ws (see setupWorkspace).
+ */
+void miniBatchKMeans(double *dataPoints, Workspace *ws, int k, int n, int d, int iter, double epsilon, KMeansOptions *options);
+/*
+ * Lays out every buffer of workspaceCount workspaces of a fit with options in arena, mapped at once
+ * after a pass that only counts their bytes, and sets up the state of every workspace for the points
+ * it assigns at a time. The threads of options are shared out between the workspaces.
+ * The points are shared by all workspaces and only given a buffer when copyPoints.
+ * With options->keepLabels every workspace also gets a trace of up to iter iterations.
+ * Returns 0 on success and else 1.
+ */
+int setupWorkspace(Workspace *workspaces, int workspaceCount, Arena *arena, KMeansOptions *options, int k, int n, int d, int iter, int copyPoints);
+/*
+ * Runs k-means on the workspace ws set up by setupWorkspace, whose centroids hold the
+ * initial centroids and are updated in place.
+ */
+void KMeans(int k, int n, int d, int iter, double *dataPoints, float *singlePoints, double epsilon, Workspace *ws, KMeansOptions *options);
+/*
+ * Makes every one of the k clusters without points hold its centroid once, so that updateCentroids leaves
+ * that centroid where it is.
+ */
+void fillEmptyClusters(double *centroids, double *clusterSums, int *clusterQtys, int k, int d);
+/*
+ * Appends the inertia of the assignment step that stored labels for the n points against centroids to trace,
+ * with a shift of 0. Does nothing without full output. Exactly one of dataPoints and singlePoints is not NULL.
+ */
+void traceAssignment(FitTrace *trace, double *dataPoints, float *singlePoints, double *centroids, int *labels, int n, int d);
+/*
+ * Sets the shift of the last step of trace to the largest of the k centroidDeltas. Does nothing without full output.
+ */
+void traceUpdate(FitTrace *trace, double *centroidDeltas, int k);
+/*
+ * Returns the number of workspaces options->restarts run in, one per restart running at once.
+ */
+int restartWorkers(KMeansOptions *options);
+/*
+ * Picks count sets of k distinct random points as initial centroids, stored set after set in centroids.
+ * Exactly one of dataPoints and singlePoints is not NULL.
+ */
+void seedRandomCentroids(double *dataPoints, float *singlePoints, double *centroids, int count, int k, int n, int d, unsigned long seed);
+/*
+ * Returns the sum of squared distances from every point to its closest centroid.
+ * Exactly one of dataPoints and singlePoints is not NULL.
+ */
+double computeInertia(double *dataPoints, float *singlePoints, double *centroids, int k, int n, int d);
+/*
+ * Runs options->restarts fits on the same points, workerCount of them at once in their own workspaces
+ * (see restartWorkers). Restart r starts from the k centroids at workspaces[0].initialCentroids + r * k * d.
+ * Leaves the centroids of the fit with the lowest inertia in workspaces[0].centroids.
+ * Returns 0 on success and 1 if the worker threads could not be started.
+ */
+int runRestarts(double *dataPoints, float *singlePoints, Workspace *workspaces, int workerCount, int k, int n, int d, int iter, double epsilon, KMeansOptions *options);
+/*
+ * Runs the restarts of workspace threadIndex of the RestartJob taskArg.
+ */
+void restartTask(void *taskArg, int threadIndex);
+/*
+ * Sets up signals for a fit called on this thread.
+ */
+void initFitSignals(FitSignals *signals);
+/*
+ * Called between iterations of a fit running without the GIL. On the thread that called fit, takes the
+ * GIL back at most every SIGNAL_CHECK_INTERVAL seconds to run the Python signal handlers, so that
+ * Ctrl-C stops the fit with the exception they raise. Returns 1 once the fit was interrupted.
+ */
+int fitInterrupted(FitSignals *signals);
+/*
+ * Returns fitArena if no other fit uses it, else initializes local and returns it, so that fits
+ * running at once from several Python threads each get their own arena.
+ */
+Arena *acquireFitArena(Arena *local);
+/*
+ * Stops the threads of the workspaceCount workspaces of fit, releases view if it is not NULL and gives
+ * back arena. fitArena stays mapped for the next fit unless it is above FIT_ARENA_KEEP_MAX or far larger than
+ * this fit needed (see FIT_ARENA_SLACK), other arenas are unmapped.
+ */
+void releaseFit(Workspace *workspaces, int workspaceCount, Arena *arena, Py_buffer *view);
+/*
+ * Unmaps the workspace of fit when the module is freed.
+ */
+void freeModule(void *module);
+/*
+ * Returns 'd' if view holds float64 values, 'f' if it holds float32 values, and else 0.
+ */
+char bufferElementType(Py_buffer *view);
+/*
+ * Gets a C contiguous buffer of count float64 or float32 values of values into view.
+ * Returns its element type as bufferElementType, or 0 (and holds no buffer) if values does not export one.
+ */
+char getValuesBuffer(PyObject *values, Py_buffer *view, Py_ssize_t count);
+/*
+ * Returns the number of values in a list of floats or in a C contiguous float64 or float32 buffer, or -1 for anything else.
+ */
+Py_ssize_t countValues(PyObject *values);
+/*
+ * Reads the count values of a list of floats or of a C contiguous float64 or float32 buffer into doubles,
+ * or into singles if doubles is NULL. Returns 0 on success and else 1.
+ */
+int readValues(PyObject *values, double *doubles, float *singles, Py_ssize_t count);
+/*
+ * Returns a copy of the count values, doubles for format "d" or ints for format "i", as a NumPy array
+ * if NumPy can be imported, else as a memoryview of that format over a bytearray. Both index, slice and
+ * export the buffer like a list of numbers would. Returns NULL with an exception set on failure.
+ */
+PyObject *valuesToPython(void *values, Py_ssize_t count, char *format);
+/*
+ * Takes the lock of model. Waits for it without the GIL, so that the call holding it can take the GIL back.
+ */
+void lockModel(KMeansModel *model);
+/*
+ * Lays out layout, model->fitLayout or model->batchLayout, for calls on up to points points, with a buffer for
+ * points that are not read in place if copyPoints. Keeps the current layout if it fits, else grows it to the
+ * largest call so far. Returns 0 on success and else 1, leaving layout without a workspace.
+ */
+int layoutModel(KMeansModel *model, ModelLayout *layout, int points, int copyPoints);
+/*
+ * Frees the state of the workspace of layout, so that it is laid out again by the next call. The threads of
+ * the model keep running.
+ */
+void freeModelLayout(ModelLayout *layout);
+/*
+ * Stores the Euclidean distances from every point from first to last - 1 to every one of the k centroids in
+ * distances (k per point), from the GEMM dot products of the points and the centroids prepared by prepareGemm.
+ * dots is the GEMM scratch of the calling thread.
+ */
+void computeDistancesGemm(double *dataPoints, double *distances, int k, int first, int last, int d, KMeansState *state, double *dots);
+/*
+ * Thread pool task of transform. taskArg is a TransformJob, every thread of its state takes a contiguous range of points.
+ */
+void transformTask(void *taskArg, int threadIndex);
+/*
+ * Returns the number of points of d values in values (see countValues), or -1 if it does not hold a positive
+ * whole number of them.
+ */
+int countPoints(PyObject *values, int d);
+/*
+ * Gets the points of values for partial_fit, predict or transform on the locked model, storing their number in m:
+ * lays out the batch layout for them and returns them read in place from a C contiguous float64 buffer (held by
+ * view, which *viewUsed then points to) or copied into the batch buffer. Returns NULL on failure.
+ */
+double *getBatch(KMeansModel *model, PyObject *values, int *m, Py_buffer *view, Py_buffer **viewUsed);
+/*
+ * Ends a failed call on the locked model: releases viewUsed if it is not NULL, unlocks the model and raises ValueError.
+ * Returns NULL.
+ */
+PyObject *modelFailed(KMeansModel *model, Py_buffer *viewUsed);
+/*
+ * Lays out the buffers of kmeans_pp in arena: n * d points if copyPoints, k * d centroids, k choices, and n distances
+ * for k-means++ and AFK-MC2 or the scratch of parallelSeeding for k-means|| unless parallelSeeding is NULL.
+ * Returns 0 on success and else 1.
+ */
+int setupSeeding(Arena *arena, double **points, double **centroids, int **choices, double **minDists, ParallelSeeding *parallelSeeding, int k, int n, int d, int copyPoints);
+/*
+ * Returns the updated centroids.
+ */
+int fit(int k, int n, int d, int iter, double epsilon, double *initialCentroids, double *dataPoint);
+
+/* squared distance kernel used by the algorithm, chosen by selectDistanceKernel */
+double (*sqDist)(double *vec1, double *vec2, int d) = sqDistScalar;
+/* GEMM microkernel, chosen by selectDistanceKernel */
+void (*gemmKernel)(double **rows, double *panel, int depthFirst, int depthLast, double *dots, int dotsStride) = gemmKernelScalar;
+/* the unrolled kernels are used for d <= fixedDimLimit, chosen by selectDistanceKernel */
+int fixedDimLimit = FIXED_DIM_MAX;
+/* blocked layout assignment kernel, chosen by selectDistanceKernel */
+void (*blockAssign)(double *block, double *centroids, int k, int d, int *closest) = blockAssignScalar;
+/* workspace of fit, kept between calls so that repeated fits reuse its mapping*/
+Arena fitArena;
+/* held by the fit using fitArena*/
+pthread_mutex_t fitArenaLock = PTHREAD_MUTEX_INITIALIZER;
+/* single precision squared distance kernel, chosen by selectDistanceKernel */
+float (*sqDistSingle)(float *vec1, float *vec2, int d) = sqDistSingleScalar;
+
+double eucDist(double *vec1, double *vec2, int d)
+{
+    return sqrt(d <= fixedDimLimit ? fixedDimSqDist[d](vec1, vec2, d) : sqDist(vec1, vec2, d));
+}
+
+double sqDistScalar(double *vec1, double *vec2, int d)
+{
+    double *p1 = vec1;
+    double *p2 = vec2;
+    double diff;
+    double distSquared = 0;
+    while (p1 < &vec1[d])
+    {
+        diff = *(p1++) - *(p2++);
+        distSquared += diff * diff;
+    }
+    return distSquared;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2"))) double sqDistSse2(double *vec1, double *vec2, int d)
+{
+    __m128d acc = _mm_setzero_pd();
+    __m128d diff;
+    double lanes[2];
+    double distSquared;
+    double tailDiff;
+    int i;
+    for (i = 0; i + 2 <= d; i += 2)
+    {
+        diff = _mm_sub_pd(_mm_loadu_pd(vec1 + i), _mm_loadu_pd(vec2 + i));
+        acc = _mm_add_pd(acc, _mm_mul_pd(diff, diff));
+    }
+    _mm_storeu_pd(lanes, acc);
+    distSquared = lanes[0] + lanes[1];
+    /* odd dimension leaves a single coordinate*/
+    for (; i < d; i++)
+    {
+        tailDiff = vec1[i] - vec2[i];
+        distSquared += tailDiff * tailDiff;
+    }
+    return distSquared;
+}
+
+__attribute__((target("avx2"))) double sqDistAvx2(double *vec1, double *vec2, int d)
+{
+    __m256d acc = _mm256_setzero_pd();
+    __m256d diff;
+    __m128d half;
+    double distSquared;
+    double tailDiff;
+    int i;
+    for (i = 0; i + 4 <= d; i += 4)
+    {
+        diff = _mm256_sub_pd(_mm256_loadu_pd(vec1 + i), _mm256_loadu_pd(vec2 + i));
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(diff, diff));
+    }
+    /* horizontal sum of the 4 lanes*/
+    half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    distSquared = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for (; i < d; i++)
+    {
+        tailDiff = vec1[i] - vec2[i];
+        distSquared += tailDiff * tailDiff;
+    }
+    return distSquared;
+}
+
+__attribute__((target("avx512f"))) double sqDistAvx512(double *vec1, double *vec2, int d)
+{
+    __m512d acc = _mm512_setzero_pd();
+    __m512d diff;
+    __mmask8 tailMask;
+    int i;
+    for (i = 0; i + 8 <= d; i += 8)
+    {
+        diff = _mm512_sub_pd(_mm512_loadu_pd(vec1 + i), _mm512_loadu_pd(vec2 + i));
+        acc = _mm512_add_pd(acc, _mm512_mul_pd(diff, diff));
+    }
+    if (i < d)
+    {
+        /* masked loads read only the remaining d - i coordinates*/
+        tailMask = (__mmask8)((1u << (d - i)) - 1);
+        diff = _mm512_sub_pd(_mm512_maskz_loadu_pd(tailMask, vec1 + i), _mm512_maskz_loadu_pd(tailMask, vec2 + i));
+        acc = _mm512_add_pd(acc, _mm512_mul_pd(diff, diff));
+    }
+    return _mm512_reduce_add_pd(acc);
+}
+#endif
+
+void gemmKernelScalar(double **rows, double *panel, int depthFirst, int depthLast, double *dots, int dotsStride)
+{
+    double acc[GEMM_MR][GEMM_NR];
+    double *panelRow;
+    double a;
+    int r;
+    int c;
+    int j;
+    for (r = 0; r < GEMM_MR; r++)
+    {
+        for (c = 0; c < GEMM_NR; c++)
+        {
+            acc[r][c] = 0;
+        }
+    }
+    for (j = depthFirst; j < depthLast; j++)
+    {
+        panelRow = panel + j * GEMM_NR;
+        for (r = 0; r < GEMM_MR; r++)
+        {
+            a = rows[r][j];
+            for (c = 0; c < GEMM_NR; c++)
+            {
+                acc[r][c] += a * panelRow[c];
+            }
+        }
+    }
+    for (r = 0; r < GEMM_MR; r++)
+    {
+        for (c = 0; c < GEMM_NR; c++)
+        {
+            dots[r * dotsStride + c] += acc[r][c];
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx2,fma"))) void gemmKernelAvx2(double **rows, double *panel, int depthFirst, int depthLast, double *dots, int dotsStride)
+{
+    /* 4 points x 8 centroids held in 8 registers*/
+    __m256d acc0Low = _mm256_setzero_pd();
+    __m256d acc0High = _mm256_setzero_pd();
+    __m256d acc1Low = _mm256_setzero_pd();
+    __m256d acc1High = _mm256_setzero_pd();
+    __m256d acc2Low = _mm256_setzero_pd();
+    __m256d acc2High = _mm256_setzero_pd();
+    __m256d acc3Low = _mm256_setzero_pd();
+    __m256d acc3High = _mm256_setzero_pd();
+    __m256d panelLow;
+    __m256d panelHigh;
+    __m256d a;
+    double *dotsRow;
+    int j;
+    for (j = depthFirst; j < depthLast; j++)
+    {
+        panelLow = _mm256_loadu_pd(panel + j * GEMM_NR);
+        panelHigh = _mm256_loadu_pd(panel + j * GEMM_NR + 4);
+        a = _mm256_broadcast_sd(&rows[0][j]);
+        acc0Low = _mm256_fmadd_pd(a, panelLow, acc0Low);
+        acc0High = _mm256_fmadd_pd(a, panelHigh, acc0High);
+        a = _mm256_broadcast_sd(&rows[1][j]);
+        acc1Low = _mm256_fmadd_pd(a, panelLow, acc1Low);
+        acc1High = _mm256_fmadd_pd(a, panelHigh, acc1High);
+        a = _mm256_broadcast_sd(&rows[2][j]);
+        acc2Low = _mm256_fmadd_pd(a, panelLow, acc2Low);
+        acc2High = _mm256_fmadd_pd(a, panelHigh, acc2High);
+        a = _mm256_broadcast_sd(&rows[3][j]);
+        acc3Low = _mm256_fmadd_pd(a, panelLow, acc3Low);
+        acc3High = _mm256_fmadd_pd(a, panelHigh, acc3High);
+    }
+    dotsRow = dots;
+    _mm256_storeu_pd(dotsRow, _mm256_add_pd(_mm256_loadu_pd(dotsRow), acc0Low));
+    _mm256_storeu_pd(dotsRow + 4, _mm256_add_pd(_mm256_loadu_pd(dotsRow + 4), acc0High));
+    dotsRow += dotsStride;
+    _mm256_storeu_pd(dotsRow, _mm256_add_pd(_mm256_loadu_pd(dotsRow), acc1Low));
+    _mm256_storeu_pd(dotsRow + 4, _mm256_add_pd(_mm256_loadu_pd(dotsRow + 4), acc1High));
+    dotsRow += dotsStride;
+    _mm256_storeu_pd(dotsRow, _mm256_add_pd(_mm256_loadu_pd(dotsRow), acc2Low));
+    _mm256_storeu_pd(dotsRow + 4, _mm256_add_pd(_mm256_loadu_pd(dotsRow + 4), acc2High));
+    dotsRow += dotsStride;
+    _mm256_storeu_pd(dotsRow, _mm256_add_pd(_mm256_loadu_pd(dotsRow), acc3Low));
+    _mm256_storeu_pd(dotsRow + 4, _mm256_add_pd(_mm256_loadu_pd(dotsRow + 4), acc3High));
+}
+#endif
+
+float sqDistSingleScalar(float *vec1, float *vec2, int d)
+{
+    float diff;
+    float distSquared = 0;
+    int i;
+    for (i = 0; i < d; i++)
+    {
+        diff = vec1[i] - vec2[i];
+        distSquared += diff * diff;
+    }
+    return distSquared;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse"))) float sqDistSingleSse(float *vec1, float *vec2, int d)
+{
+    __m128 acc = _mm_setzero_ps();
+    __m128 diff;
+    float lanes[4];
+    float distSquared;
+    float tailDiff;
+    int i;
+    for (i = 0; i + 4 <= d; i += 4)
+    {
+        diff = _mm_sub_ps(_mm_loadu_ps(vec1 + i), _mm_loadu_ps(vec2 + i));
+        acc = _mm_add_ps(acc, _mm_mul_ps(diff, diff));
+    }
+    _mm_storeu_ps(lanes, acc);
+    distSquared = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < d; i++)
+    {
+        tailDiff = vec1[i] - vec2[i];
+        distSquared += tailDiff * tailDiff;
+    }
+    return distSquared;
+}
+
+__attribute__((target("avx2"))) float sqDistSingleAvx2(float *vec1, float *vec2, int d)
+{
+    __m256 acc = _mm256_setzero_ps();
+    __m256 diff;
+    __m128 half;
+    float distSquared;
+    float tailDiff;
+    int i;
+    for (i = 0; i + 8 <= d; i += 8)
+    {
+        diff = _mm256_sub_ps(_mm256_loadu_ps(vec1 + i), _mm256_loadu_ps(vec2 + i));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(diff, diff));
+    }
+    /* horizontal sum of the 8 lanes*/
+    half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    distSquared = _mm_cvtss_f32(_mm_add_ss(half, _mm_shuffle_ps(half, half, 1)));
+    for (; i < d; i++)
+    {
+        tailDiff = vec1[i] - vec2[i];
+        distSquared += tailDiff * tailDiff;
+    }
+    return distSquared;
+}
+
+__attribute__((target("avx512f"))) float sqDistSingleAvx512(float *vec1, float *vec2, int d)
+{
+    __m512 acc = _mm512_setzero_ps();
+    __m512 diff;
+    __mmask16 tailMask;
+    int i;
+    for (i = 0; i + 16 <= d; i += 16)
+    {
+        diff = _mm512_sub_ps(_mm512_loadu_ps(vec1 + i), _mm512_loadu_ps(vec2 + i));
+        acc = _mm512_add_ps(acc, _mm512_mul_ps(diff, diff));
+    }
+    if (i < d)
+    {
+        tailMask = (__mmask16)((1u << (d - i)) - 1);
+        diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(tailMask, vec1 + i), _mm512_maskz_loadu_ps(tailMask, vec2 + i));
+        acc = _mm512_add_ps(acc, _mm512_mul_ps(diff, diff));
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+#endif
+
+void blockAssignScalar(double *block, double *centroids, int k, int d, int *closest)
+{
+    double dists[POINT_BLOCK_LANES];
+    double minDists[POINT_BLOCK_LANES];
+    double *lanes;
+    double diff;
+    int c;
+    int j;
+    int l;
+    for (c = 0; c < k; c++, centroids += d)
+    {
+        for (l = 0; l < POINT_BLOCK_LANES; l++)
+        {
+            dists[l] = 0;
+        }
+        for (j = 0, lanes = block; j < d; j++, lanes += POINT_BLOCK_LANES)
+        {
+            for (l = 0; l < POINT_BLOCK_LANES; l++)
+            {
+                diff = lanes[l] - centroids[j];
+                dists[l] += diff * diff;
+            }
+        }
+        for (l = 0; l < POINT_BLOCK_LANES; l++)
+        {
+            if (c == 0 || dists[l] < minDists[l])
+            {
+                minDists[l] = dists[l];
+                closest[l] = c;
+            }
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2"))) void blockAssignSse2(double *block, double *centroids, int k, int d, int *closest)
+{
+    __m128d acc[POINT_BLOCK_LANES / 2];
+    __m128d minDists[POINT_BLOCK_LANES / 2];
+    __m128d best[POINT_BLOCK_LANES / 2]; /* closest centroid of every lane, as a double*/
+    __m128d coordinate;
+    __m128d diff;
+    __m128d closer;
+    __m128d index;
+    double bestLanes[POINT_BLOCK_LANES];
+    double *lanes;
+    int c;
+    int j;
+    int v;
+    for (v = 0; v < POINT_BLOCK_LANES / 2; v++)
+    {
+        minDists[v] = _mm_setzero_pd();
+        best[v] = _mm_setzero_pd();
+    }
+    for (c = 0; c < k; c++, centroids += d)
+    {
+        for (v = 0; v < POINT_BLOCK_LANES / 2; v++)
+        {
+            acc[v] = _mm_setzero_pd();
+        }
+        for (j = 0, lanes = block; j < d; j++, lanes += POINT_BLOCK_LANES)
+        {
+            coordinate = _mm_set1_pd(centroids[j]);
+            for (v = 0; v < POINT_BLOCK_LANES / 2; v++)
+            {
+                diff = _mm_sub_pd(_mm_loadu_pd(lanes + 2 * v), coordinate);
+                acc[v] = _mm_add_pd(acc[v], _mm_mul_pd(diff, diff));
+            }
+        }
+        index = _mm_set1_pd(c);
+        for (v = 0; v < POINT_BLOCK_LANES / 2; v++)
+        {
+            closer = c == 0 ? _mm_cmpeq_pd(index, index) : _mm_cmplt_pd(acc[v], minDists[v]);
+            minDists[v] = _mm_or_pd(_mm_and_pd(closer, acc[v]), _mm_andnot_pd(closer, minDists[v]));
+            best[v] = _mm_or_pd(_mm_and_pd(closer, index), _mm_andnot_pd(closer, best[v]));
+        }
+    }
+    for (v = 0; v < POINT_BLOCK_LANES / 2; v++)
+    {
+        _mm_storeu_pd(bestLanes + 2 * v, best[v]);
+    }
+    for (v = 0; v < POINT_BLOCK_LANES; v++)
+    {
+        closest[v] = (int)bestLanes[v];
+    }
+}
+
+__attribute__((target("avx2"))) void blockAssignAvx2(double *block, double *centroids, int k, int d, int *closest)
+{
+    __m256d low;
+    __m256d high;
+    __m256d minLow = _mm256_setzero_pd();
+    __m256d minHigh = _mm256_setzero_pd();
+    __m256d bestLow = _mm256_setzero_pd(); /* closest centroid of every lane, as a double*/
+    __m256d bestHigh = _mm256_setzero_pd();
+    __m256d coordinate;
+    __m256d diff;
+    __m256d index;
+    __m256d closer;
+    double bestLanes[POINT_BLOCK_LANES];
+    double *lanes;
+    int c;
+    int j;
+    for (c = 0; c < k; c++, centroids += d)
+    {
+        low = _mm256_setzero_pd();
+        high = _mm256_setzero_pd();
+        for (j = 0, lanes = block; j < d; j++, lanes += POINT_BLOCK_LANES)
+        {
+            coordinate = _mm256_set1_pd(centroids[j]);
+            diff = _mm256_sub_pd(_mm256_loadu_pd(lanes), coordinate);
+            low = _mm256_add_pd(low, _mm256_mul_pd(diff, diff));
+            diff = _mm256_sub_pd(_mm256_loadu_pd(lanes + 4), coordinate);
+            high = _mm256_add_pd(high, _mm256_mul_pd(diff, diff));
+        }
+        if (c == 0)
+        {
+            minLow = low;
+            minHigh = high;
+            continue;
+        }
+        index = _mm256_set1_pd(c);
+        closer = _mm256_cmp_pd(low, minLow, _CMP_LT_OQ);
+        minLow = _mm256_blendv_pd(minLow, low, closer);
+        bestLow = _mm256_blendv_pd(bestLow, index, closer);
+        closer = _mm256_cmp_pd(high, minHigh, _CMP_LT_OQ);
+        minHigh = _mm256_blendv_pd(minHigh, high, closer);
+        bestHigh = _mm256_blendv_pd(bestHigh, index, closer);
+    }
+    _mm256_storeu_pd(bestLanes, bestLow);
+    _mm256_storeu_pd(bestLanes + 4, bestHigh);
+    for (j = 0; j < POINT_BLOCK_LANES; j++)
+    {
+        closest[j] = (int)bestLanes[j];
+    }
+}
+
+__attribute__((target("avx512f"))) void blockAssignAvx512(double *block, double *centroids, int k, int d, int *closest)
+{
+    __m512d acc;
+    __m512d minDists = _mm512_setzero_pd();
+    __m512d best = _mm512_setzero_pd(); /* closest centroid of every lane, as a double*/
+    __m512d diff;
+    __mmask8 closer;
+    double bestLanes[POINT_BLOCK_LANES];
+    double *lanes;
+    int c;
+    int j;
+    for (c = 0; c < k; c++, centroids += d)
+    {
+        acc = _mm512_setzero_pd();
+        for (j = 0, lanes = block; j < d; j++, lanes += POINT_BLOCK_LANES)
+        {
+            diff = _mm512_sub_pd(_mm512_loadu_pd(lanes), _mm512_set1_pd(centroids[j]));
+            acc = _mm512_add_pd(acc, _mm512_mul_pd(diff, diff));
+        }
+        closer = c == 0 ? (__mmask8)0xff : _mm512_cmp_pd_mask(acc, minDists, _CMP_LT_OQ);
+        minDists = _mm512_mask_mov_pd(minDists, closer, acc);
+        best = _mm512_mask_mov_pd(best, closer, _mm512_set1_pd(c));
+    }
+    _mm512_storeu_pd(bestLanes, best);
+    for (j = 0; j < POINT_BLOCK_LANES; j++)
+    {
+        closest[j] = (int)bestLanes[j];
+    }
+}
+#endif
+
+/* one term of the squared distance between vec and centroid, in the order of sqDistScalar*/
+#define FIXED_DIM_DIST_TERM(j)   \
+    diff = vec[j] - centroid[j]; \
+    dist += diff * diff;
+/*
+ * The same term for the FIXED_DIM_CENTROIDS centroids in quad.
+ */
+#define FIXED_DIM_MULTI_TERM(j)                                                                                                   \
+    diffs[0] = vec[j] - quad[0][j];                                                                                               \
+    diffs[1] = vec[j] - quad[1][j];                                                                                               \
+    diffs[2] = vec[j] - quad[2][j];                                                                                               \
+    diffs[3] = vec[j] - quad[3][j];                                                                                               \
+    dists[0] += diffs[0] * diffs[0];                                                                                              \
+    dists[1] += diffs[1] * diffs[1];                                                                                              \
+    dists[2] += diffs[2] * diffs[2];                                                                                              \
+    dists[3] += diffs[3] * diffs[3];
+#define FIXED_DIM_SUM_TERM(j) clusterSum[j] += vec[j];
+/*
+ * Defines sqDistFixedD and computeClusterSumsFixedD, variants of sqDistScalar and
+ * computeClusterSums for points of dimension exactly D. Their loops over the
+ * coordinates are unrolled, and every distance is summed in the order of sqDistScalar.
+ * When labels is not NULL, computeClusterSumsFixedD stores the closest centroid of
+ * every point there, and only does so when clusterSums is NULL.
+ */
+#define FIXED_DIM_KERNELS(D)                                                                                                      \
+    double sqDistFixed##D(double *vec, double *centroid, int d)                                                                   \
+    {                                                                                                                             \
+        double diff;                                                                                                              \
+        double dist = 0;                                                                                                          \
+        (void)d;                                                                                                                  \
+        UNROLL_##D(FIXED_DIM_DIST_TERM)                                                                                           \
+        return dist;                                                                                                              \
+    }                                                                                                                             \
+    void computeClusterSumsFixed##D(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int n, int d, \
+                                    int *labels)                                                                                  \
+    {                                                                                                                             \
+        double *vec = dataPoints;                                                                                                 \
+        double *centroid;                                                                                                         \
+        double *quad[FIXED_DIM_CENTROIDS];                                                                                        \
+        double *clusterSum;                                                                                                       \
+        double diff;                                                                                                              \
+        double diffs[FIXED_DIM_CENTROIDS];                                                                                        \
+        double dist;                                                                                                              \
+        double dists[FIXED_DIM_CENTROIDS];                                                                                        \
+        double minDist;                                                                                                           \
+        int closestCluster;                                                                                                       \
+        int i;                                                                                                                    \
+        int c;                                                                                                                    \
+        (void)d;                                                                                                                  \
+        for (i = 0; i < n; i++, vec += D)                                                                                         \
+        {                                                                                                                         \
+            closestCluster = 0;                                                                                                   \
+            centroid = centroids;                                                                                                 \
+            dist = 0;                                                                                                             \
+            UNROLL_##D(FIXED_DIM_DIST_TERM)                                                                                       \
+            minDist = dist;                                                                                                       \
+            for (c = 1; c + FIXED_DIM_CENTROIDS <= k; c += FIXED_DIM_CENTROIDS)                                                   \
+            {                                                                                                                     \
+                quad[0] = &centroids[c * D];                                                                                      \
+                quad[1] = quad[0] + D;                                                                                            \
+                quad[2] = quad[1] + D;                                                                                            \
+                quad[3] = quad[2] + D;                                                                                            \
+                dists[0] = dists[1] = dists[2] = dists[3] = 0;                                                                    \
+                UNROLL_##D(FIXED_DIM_MULTI_TERM)                                                                                  \
+                if (dists[0] < minDist)                                                                                           \
+                {                                                                                                                 \
+                    minDist = dists[0];                                                                                           \
+                    closestCluster = c + 0;                                                                                       \
+                }                                                                                                                 \
+                if (dists[1] < minDist)                                                                                           \
+                {                                                                                                                 \
+                    minDist = dists[1];                                                                                           \
+                    closestCluster = c + 1;                                                                                       \
+                }                                                                                                                 \
+                if (dists[2] < minDist)                                                                                           \
+                {                                                                                                                 \
+                    minDist = dists[2];                                                                                           \
+                    closestCluster = c + 2;                                                                                       \
+                }                                                                                                                 \
+                if (dists[3] < minDist)                                                                                           \
+                {                                                                                                                 \
+                    minDist = dists[3];                                                                                           \
+                    closestCluster = c + 3;                                                                                       \
+                }                                                                                                                 \
+            }                                                                                                                     \
+            for (; c < k; c++)                                                                                                    \
+            {                                                                                                                     \
+                centroid = &centroids[c * D];                                                                                     \
+                dist = 0;                                                                                                         \
+                UNROLL_##D(FIXED_DIM_DIST_TERM)                                                                                   \
+                if (dist < minDist)                                                                                               \
+                {                                                                                                                 \
+                    minDist = dist;                                                                                               \
+                    closestCluster = c;                                                                                           \
+                }                                                                                                                 \
+            }                                                                                                                     \
+            if (labels != NULL)                                                                                                   \
+            {                                                                                                                     \
+                labels[i] = closestCluster;                                                                                       \
+            }                                                                                                                     \
+            if (clusterSums == NULL)                                                                                              \
+            {                                                                                                                     \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            clusterQtys[closestCluster]++;                                                                                        \
+            clusterSum = &clusterSums[closestCluster * D];                                                                        \
+            UNROLL_##D(FIXED_DIM_SUM_TERM)                                                                                        \
+        }                                                                                                                         \
+    }
+
+FIXED_DIM_KERNELS(1)
+FIXED_DIM_KERNELS(2)
+FIXED_DIM_KERNELS(3)
+FIXED_DIM_KERNELS(4)
+FIXED_DIM_KERNELS(5)
+FIXED_DIM_KERNELS(6)
+FIXED_DIM_KERNELS(7)
+FIXED_DIM_KERNELS(8)
+FIXED_DIM_KERNELS(9)
+FIXED_DIM_KERNELS(10)
+FIXED_DIM_KERNELS(11)
+FIXED_DIM_KERNELS(12)
+FIXED_DIM_KERNELS(13)
+FIXED_DIM_KERNELS(14)
+FIXED_DIM_KERNELS(15)
+FIXED_DIM_KERNELS(16)
+FIXED_DIM_KERNELS(17)
+FIXED_DIM_KERNELS(18)
+FIXED_DIM_KERNELS(19)
+FIXED_DIM_KERNELS(20)
+FIXED_DIM_KERNELS(21)
+FIXED_DIM_KERNELS(22)
+FIXED_DIM_KERNELS(23)
+FIXED_DIM_KERNELS(24)
+FIXED_DIM_KERNELS(25)
+FIXED_DIM_KERNELS(26)
+FIXED_DIM_KERNELS(27)
+FIXED_DIM_KERNELS(28)
+FIXED_DIM_KERNELS(29)
+FIXED_DIM_KERNELS(30)
+FIXED_DIM_KERNELS(31)
+FIXED_DIM_KERNELS(32)
+
+/* the unrolled kernels by dimension, used for d <= FIXED_DIM_MAX*/
+double (*fixedDimSqDist[FIXED_DIM_MAX + 1])(double *vec1, double *vec2, int d) = {
+    NULL,
+    sqDistFixed1, sqDistFixed2, sqDistFixed3, sqDistFixed4, sqDistFixed5, sqDistFixed6, sqDistFixed7, sqDistFixed8,
+    sqDistFixed9, sqDistFixed10, sqDistFixed11, sqDistFixed12, sqDistFixed13, sqDistFixed14, sqDistFixed15, sqDistFixed16,
+    sqDistFixed17, sqDistFixed18, sqDistFixed19, sqDistFixed20, sqDistFixed21, sqDistFixed22, sqDistFixed23, sqDistFixed24,
+    sqDistFixed25, sqDistFixed26, sqDistFixed27, sqDistFixed28, sqDistFixed29, sqDistFixed30, sqDistFixed31, sqDistFixed32};
+void (*fixedDimClusterSums[FIXED_DIM_MAX + 1])(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int n, int d, int *labels) = {
+    NULL,
+    computeClusterSumsFixed1, computeClusterSumsFixed2, computeClusterSumsFixed3, computeClusterSumsFixed4, computeClusterSumsFixed5, computeClusterSumsFixed6, computeClusterSumsFixed7, computeClusterSumsFixed8,
+    computeClusterSumsFixed9, computeClusterSumsFixed10, computeClusterSumsFixed11, computeClusterSumsFixed12, computeClusterSumsFixed13, computeClusterSumsFixed14, computeClusterSumsFixed15, computeClusterSumsFixed16,
+    computeClusterSumsFixed17, computeClusterSumsFixed18, computeClusterSumsFixed19, computeClusterSumsFixed20, computeClusterSumsFixed21, computeClusterSumsFixed22, computeClusterSumsFixed23, computeClusterSumsFixed24,
+    computeClusterSumsFixed25, computeClusterSumsFixed26, computeClusterSumsFixed27, computeClusterSumsFixed28, computeClusterSumsFixed29, computeClusterSumsFixed30, computeClusterSumsFixed31, computeClusterSumsFixed32};
+
+void selectDistanceKernel(void)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        sqDist = sqDistAvx512;
+        blockAssign = blockAssignAvx512;
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        sqDist = sqDistAvx2;
+        blockAssign = blockAssignAvx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        sqDist = sqDistSse2;
+        blockAssign = blockAssignSse2;
+    }
+    else
+    {
+        sqDist = sqDistScalar;
+        blockAssign = blockAssignScalar;
+    }
+    gemmKernel = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? gemmKernelAvx2 : gemmKernelScalar;
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        sqDistSingle = sqDistSingleAvx512;
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        sqDistSingle = sqDistSingleAvx2;
+    }
+    else if (__builtin_cpu_supports("sse"))
+    {
+        sqDistSingle = sqDistSingleSse;
+    }
+    else
+    {
+        sqDistSingle = sqDistSingleScalar;
+    }
+    /* from the CPU only, so every build of one machine picks the same kernels and sums*/
+    fixedDimLimit = sqDist == sqDistScalar ? FIXED_DIM_MAX : FIXED_DIM_SIMD_MAX;
+#else
+    sqDist = sqDistScalar;
+    blockAssign = blockAssignScalar;
+    gemmKernel = gemmKernelScalar;
+    sqDistSingle = sqDistSingleScalar;
+    fixedDimLimit = FIXED_DIM_MAX;
+#endif
+}
+
+int updateCentroid(double *centroid, double *clusterSum, int clusterQty, int d, double epsilon, double *delta)
+{
+    double *newCentroidCursor; /* pointer in clusterSum array*/
+    double *clusterSumEnd;     /* end of clusterSum, for loops*/
+    double *oldCentroidCursor; /* pointer in centroid*/
+    double dist;
+    clusterSumEnd = clusterSum + d;
+    /* divide sum by cluster size to get new centroid*/
+    for (newCentroidCursor = clusterSum; newCentroidCursor < clusterSumEnd; ++newCentroidCursor)
+    {
+        *newCentroidCursor = *newCentroidCursor / clusterQty;
+    }
+    dist = eucDist(clusterSum, centroid, d); /* for convergence condition*/
+    /* copy new centroid to new centroid array*/
+    for (newCentroidCursor = clusterSum, oldCentroidCursor = centroid;
+         newCentroidCursor < clusterSumEnd; ++newCentroidCursor, ++oldCentroidCursor)
+    {
+        *oldCentroidCursor = *newCentroidCursor;
+    }
+    *delta = dist;
+    return dist < epsilon;
+}
+
+void clearClusters(double *clusterSums, int *clusterQtys, int k, int d)
+{
+    double *clusterSumsEnd; /* pointer to end of clusterSums array*/
+    int *clusterQtysEnd;    /* pointer to end of clusterQtysEnd*/
+
+    clusterSumsEnd = clusterSums + k * d;
+    /* clearing clusterSums array*/
+    while (clusterSums < clusterSumsEnd)
+    {
+        *(clusterSums++) = 0;
+    }
+
+    clusterQtysEnd = clusterQtys + k;
+    /* clearing clusterQtys array*/
+    while (clusterQtys < clusterQtysEnd)
+    {
+        *(clusterQtys++) = 0;
+    }
+}
+
+int updateCentroids(double *centroids, double *clusterSums, int *clusterQtys, int k, int d, double epsilon, double *centroidDeltas)
+{
+    int res = 1;
+    double *centroidsCursor = centroids;
+    double *clusterSumsCursor = clusterSums;
+    int *clusterQtysCursor = clusterQtys;
+    int i;
+    for (i = 0; i < k; i++)
+    {
+        /* update current centroid. Change res to false if current centroid does not*/
+        /* abide convergence condition in this iteration.*/
+        res = updateCentroid(centroidsCursor, clusterSumsCursor, *clusterQtysCursor, d, epsilon, &centroidDeltas[i]) && res;
+
+        /* advance cursors*/
+        centroidsCursor += d;
+        clusterSumsCursor += d;
+        clusterQtysCursor++;
+    }
+    clearClusters(clusterSums, clusterQtys, k, d);
+    return res;
+}
+
+int updateClusters(double *vec, double *centroids, double *clusterSums, int *clusterQtys, int k, int d)
+{
+    /* Finding closest cluster. Squared distances are compared since sqrt is monotonic.*/
+    int closestCluster = 0;
+    double minDist = sqDist(vec, centroids, d);
+    double *centroidsCursor = &centroids[d];
+    double dist;
+    double *clusterSumsCursor;
+    double *vecCursor;
+    int i;
+    for (i = 1; i < k; i++)
+    {
+        dist = sqDist(vec, centroidsCursor, d);
+        if (dist < minDist)
+        {
+            minDist = dist;
+            closestCluster = i; /* maintaining the closest cluster*/
+        }
+
+        centroidsCursor += d; /* updating centroidsCursor to the next centroid*/
+    }
+
+    /* Now closestCluster is the index of the closest cluster.*/
+    /* We will proceed to update clusterSums and clusterQtys.*/
+    clusterQtys[closestCluster]++;
+    /* incrementing counter of elements in closest clusterv*/
+    clusterSumsCursor = &clusterSums[closestCluster * d]; /* now points to the start of the sum of data points in the closest cluster*/
+    /* adding current data points to sum of closest cluster*/
+
+    for (vecCursor = vec; vecCursor < &vec[d]; vecCursor++)
+    {
+        *clusterSumsCursor += *vecCursor;
+        clusterSumsCursor++; /* progressing along cluster sum too*/
+    }
+
+    /* the function is done, so will exit.*/
+    return closestCluster;
+}
+
+void computeClusterSums(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int n, int d, int *labels)
+{
+    double *dataPointsEnd = dataPoints + n * d; /* end of dataPoints array*/
+    int closestCluster;
+    if (d <= fixedDimLimit)
+    {
+        fixedDimClusterSums[d](dataPoints, centroids, clusterSums, clusterQtys, k, n, d, labels);
+        return;
+    }
+    while (dataPoints < dataPointsEnd)
+    {
+        /* for every data point, update the clusterSums*/
+        closestCluster = updateClusters(dataPoints, centroids, clusterSums, clusterQtys, k, d);
+        if (labels != NULL)
+        {
+            *labels++ = closestCluster;
+        }
+        dataPoints += d;
+    }
+    /* function is done, so will return*/
+}
+
+int algorithmFromName(char *name)
+{
+    if (strcmp(name, "lloyd") == 0)
+    {
+        return ALGORITHM_LLOYD;
+    }
+    if (strcmp(name, "elkan") == 0)
+    {
+        return ALGORITHM_ELKAN;
+    }
+    if (strcmp(name, "hamerly") == 0)
+    {
+        return ALGORITHM_HAMERLY;
+    }
+    if (strcmp(name, "accelerated") == 0)
+    {
+        return ALGORITHM_ACCELERATED;
+    }
+    if (strcmp(name, "yinyang") == 0)
+    {
+        return ALGORITHM_YINYANG;
+    }
+    if (strcmp(name, "gemm") == 0)
+    {
+        return ALGORITHM_GEMM;
+    }
+    if (strcmp(name, "kdtree") == 0)
+    {
+        return ALGORITHM_KDTREE;
+    }
+    return -1;
+}
+
+int initKMeansState(KMeansState *state, KMeansOptions *options, int k, int n, int d, Arena *arena)
+{
+    int algorithm = options->algorithm;
+    int nodeCount;
+    int i;
+    if (algorithm == ALGORITHM_ACCELERATED)
+    {
+        algorithm = k <= ELKAN_MAX_K ? ALGORITHM_ELKAN : ALGORITHM_HAMERLY;
+    }
+    /* bounds and GEMM work on double points in rows, so single precision and the blocked layout always run Lloyd.
+       Incremental sums follow the labels of the points, which GEMM and the kd-tree do not keep*/
+    if (options->singlePrecision || options->blockedLayout ||
+        (options->incremental && (algorithm == ALGORITHM_GEMM || algorithm == ALGORITHM_KDTREE)))
+    {
+        algorithm = ALGORITHM_LLOYD;
+    }
+    state->algorithm = algorithm;
+    state->boundsReady = 0;
+    state->groupCount = (k + YINYANG_GROUP_SIZE - 1) / YINYANG_GROUP_SIZE;
+    state->movedPoints = -1;
+    state->singlePoints = NULL;
+    state->threadCount = options->threadCount < n ? options->threadCount : n;
+    if (state->threadCount < 1)
+    {
+        state->threadCount = 1; /* no points still runs serially*/
+    }
+    if (options->pool != NULL && state->threadCount > options->pool->threadCount)
+    {
+        state->threadCount = options->pool->threadCount;
+    }
+    state->ownPool.threadCount = 1;
+    state->pool = options->pool != NULL ? options->pool : &state->ownPool;
+    state->deterministic = options->deterministic;
+    state->chunkCount = DETERMINISTIC_CHUNKS < n ? DETERMINISTIC_CHUNKS : n;
+    /* every accumulator holds k * d sums and k quantities, padded to whole cache lines*/
+    state->accumulatorStride = ((k * d * sizeof(double) + k * sizeof(int) + CACHE_LINE - 1) / CACHE_LINE) * CACHE_LINE;
+
+    state->labels = NULL;
+    state->upperBounds = NULL;
+    state->lowerBounds = NULL;
+    state->halfCentroidDists = NULL;
+    state->halfMinDists = NULL;
+    state->centroidGroups = NULL;
+    state->groupMembers = NULL;
+    state->groupStarts = NULL;
+    state->groupDeltas = NULL;
+    state->oldGroupBounds = NULL;
+    state->pointNorms = NULL;
+    state->centroidNorms = NULL;
+    state->packedCentroids = NULL;
+    state->gemmDots = NULL;
+    state->gemmClosest = NULL;
+    state->kdNodes = NULL;
+    state->kdOrder = NULL;
+    state->kdCells = NULL;
+    state->kdSums = NULL;
+    state->kdCandidates = NULL;
+    state->kdMidpoints = NULL;
+    state->singleCentroids = NULL;
+    state->blockedPoints = NULL;
+    state->countedLabels = NULL;
+    state->incrementalSums = NULL;
+    state->incrementalQtys = NULL;
+    state->accumulators = NULL;
+    state->centroidDeltas = (double *)arenaAllocZeroed(arena, k * sizeof(double));
+    if (state->threadCount > 1 || state->deterministic)
+    {
+        state->accumulators = (char *)arenaAlloc(arena, state->accumulatorStride * (state->deterministic ? state->chunkCount : state->threadCount));
+    }
+    if (options->incremental)
+    {
+        state->countedLabels = (int *)arenaAlloc(arena, n * sizeof(int));
+        state->incrementalSums = (double *)arenaAllocZeroed(arena, k * d * sizeof(double));
+        state->incrementalQtys = (int *)arenaAllocZeroed(arena, k * sizeof(int));
+    }
+
+    if (options->singlePrecision)
+    {
+        state->singleCentroids = (float *)arenaAlloc(arena, k * d * sizeof(float));
+    }
+    else if (options->blockedLayout)
+    {
+        state->blockedPoints = (double *)arenaAlloc(arena, (size_t)(n + POINT_BLOCK_LANES - 1) / POINT_BLOCK_LANES * POINT_BLOCK_LANES * d * sizeof(double));
+    }
+    else if (algorithm == ALGORITHM_LLOYD)
+    {
+        if (options->incremental)
+        {
+            state->labels = (int *)arenaAlloc(arena, n * sizeof(int));
+        }
+    }
+    else if (algorithm == ALGORITHM_GEMM)
+    {
+        state->pointNorms = (double *)arenaAlloc(arena, n * sizeof(double));
+        state->centroidNorms = (double *)arenaAlloc(arena, k * sizeof(double));
+        state->gemmDots = (double *)arenaAlloc(arena, (size_t)state->threadCount * (GEMM_POINT_BLOCK * GEMM_CENTROID_BLOCK + GEMM_POINT_BLOCK) * sizeof(double));
+        state->gemmClosest = (int *)arenaAlloc(arena, (size_t)state->threadCount * GEMM_POINT_BLOCK * sizeof(int));
+        state->packedCentroids = (double *)arenaAlloc(arena, (size_t)((k + GEMM_NR - 1) / GEMM_NR) * GEMM_NR * d * sizeof(double));
+    }
+    else if (algorithm == ALGORITHM_KDTREE)
+    {
+        /* leaves hold at least KDTREE_LEAF_SIZE / 2 points, and a binary tree has fewer than twice as many nodes as leaves*/
+        nodeCount = 2 * (n / (KDTREE_LEAF_SIZE / 2) + 1);
+        state->kdNodes = (KdNode *)arenaAlloc(arena, nodeCount * sizeof(KdNode));
+        state->kdOrder = (int *)arenaAlloc(arena, n * sizeof(int));
+        state->kdCells = (double *)arenaAlloc(arena, (size_t)nodeCount * 2 * d * sizeof(double));
+        state->kdSums = (double *)arenaAlloc(arena, (size_t)nodeCount * d * sizeof(double));
+        state->kdCandidates = (int *)arenaAlloc(arena, (size_t)state->threadCount * (KDTREE_MAX_DEPTH + 2) * k * sizeof(int));
+        state->kdMidpoints = (double *)arenaAlloc(arena, (size_t)state->threadCount * d * sizeof(double));
+    }
+    else
+    {
+        state->labels = (int *)arenaAlloc(arena, n * sizeof(int));
+        state->upperBounds = (double *)arenaAlloc(arena, n * sizeof(double));
+        if (algorithm == ALGORITHM_ELKAN)
+        {
+            state->lowerBounds = (double *)arenaAlloc(arena, (size_t)n * k * sizeof(double));
+            state->halfCentroidDists = (double *)arenaAlloc(arena, (size_t)k * k * sizeof(double));
+            state->halfMinDists = (double *)arenaAlloc(arena, k * sizeof(double));
+        }
+        else if (algorithm == ALGORITHM_HAMERLY)
+        {
+            state->lowerBounds = (double *)arenaAlloc(arena, n * sizeof(double));
+            state->halfMinDists = (double *)arenaAlloc(arena, k * sizeof(double));
+        }
+        else
+        {
+            state->lowerBounds = (double *)arenaAlloc(arena, (size_t)n * state->groupCount * sizeof(double));
+            state->centroidGroups = (int *)arenaAlloc(arena, k * sizeof(int));
+            state->groupMembers = (int *)arenaAlloc(arena, k * sizeof(int));
+            state->groupStarts = (int *)arenaAlloc(arena, (state->groupCount + 1) * sizeof(int));
+            state->groupDeltas = (double *)arenaAlloc(arena, state->groupCount * sizeof(double));
+            state->oldGroupBounds = (double *)arenaAlloc(arena, (size_t)state->groupCount * state->threadCount * sizeof(double));
+        }
+    }
+    /* the other algorithms only store labels on request*/
+    if (options->keepLabels && state->labels == NULL)
+    {
+        state->labels = (int *)arenaAlloc(arena, n * sizeof(int));
+    }
+    if (arena->sizing)
+    {
+        return 0;
+    }
+
+    if (state->countedLabels != NULL)
+    {
+        for (i = 0; i < n; i++)
+        {
+            state->countedLabels[i] = -1;
+        }
+    }
+    if (state->threadCount > 1 && state->pool == &state->ownPool)
+    {
+        return startThreadPool(&state->ownPool, state->threadCount);
+    }
+    return 0;
+}
+
+void freeKMeansState(KMeansState *state)
+{
+    if (state->ownPool.threadCount > 1)
+    {
+        stopThreadPool(&state->ownPool);
+    }
+}
+
+void restartKMeansState(KMeansState *state, int k, int n, int d)
+{
+    int i;
+    /* only the triangle inequality algorithms keep bounds on the distances to the old centroids*/
+    if (state->upperBounds != NULL)
+    {
+        state->boundsReady = 0;
+    }
+    state->movedPoints = -1;
+    if (state->countedLabels != NULL)
+    {
+        for (i = 0; i < n; i++)
+        {
+            state->countedLabels[i] = -1;
+        }
+        clearClusters(state->incrementalSums, state->incrementalQtys, k, d);
+    }
+}
+
+void arenaInit(Arena *arena)
+{
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+    arena->sizing = 0;
+    arena->hugePages = 0;
+}
+
+void arenaStartSizing(Arena *arena)
+{
+    arena->sizing = 1;
+    arena->used = 0;
+}
+
+void *arenaAlloc(Arena *arena, size_t size)
+{
+    size_t offset = arena->used;
+    arena->used += (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    return arena->sizing ? NULL : arena->base + offset;
+}
+
+void *arenaAllocZeroed(Arena *arena, size_t size)
+{
+    void *buffer = arenaAlloc(arena, size);
+    if (buffer != NULL)
+    {
+        memset(buffer, 0, size);
+    }
+    return buffer;
+}
+
+int arenaReserve(Arena *arena, int hugePages)
+{
+    size_t need = arena->used > 0 ? arena->used : CACHE_LINE;
+    size_t size = need;
+    void *base = MAP_FAILED;
+
+    arena->sizing = 0;
+    arena->used = 0;
+    if (arena->base != NULL && arena->size >= need && arena->hugePages == hugePages)
+    {
+        return 0;
+    }
+    arenaRelease(arena);
+    if (hugePages)
+    {
+        size = (need + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    }
+    if (base == MAP_FAILED)
+    {
+        /* no reserved huge pages, so transparent huge pages are asked for instead*/
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            return 1;
+        }
+#ifdef MADV_HUGEPAGE
+        if (hugePages)
+        {
+            madvise(base, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    arena->base = (char *)base;
+    arena->size = size;
+    arena->hugePages = hugePages;
+    return 0;
+}
+
+void arenaRelease(Arena *arena)
+{
+    if (arena->base != NULL)
+    {
+        munmap(arena->base, arena->size);
+    }
+    arena->base = NULL;
+    arena->size = 0;
+}
+
+void *threadPoolWorker(void *arg)
+{
+    ThreadPoolWorker *worker = (ThreadPoolWorker *)arg;
+    ThreadPool *pool = worker->pool;
+    int seenGeneration = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (pool->generation == seenGeneration && !pool->stopping)
+        {
+            pthread_cond_wait(&pool->workReady, &pool->lock);
+        }
+        if (pool->stopping)
+        {
+            break;
+        }
+        seenGeneration = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        pool->task(pool->taskArg, worker->index);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+        {
+            pthread_cond_signal(&pool->workDone);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int startThreadPool(ThreadPool *pool, int threadCount)
+{
+    int i;
+    pool->threadCount = 1;
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->stopping = 0;
+    pool->workers = (ThreadPoolWorker *)malloc((threadCount - 1) * sizeof(ThreadPoolWorker));
+    if (pool->workers == NULL)
+    {
+        return 1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workReady, NULL);
+    pthread_cond_init(&pool->workDone, NULL);
+    /* the calling thread acts as thread 0, so only threadCount - 1 threads are created*/
+    for (i = 1; i < threadCount; i++)
+    {
+        pool->workers[i - 1].pool = pool;
+        pool->workers[i - 1].index = i;
+        if (pthread_create(&pool->workers[i - 1].thread, NULL, threadPoolWorker, &pool->workers[i - 1]) != 0)
+        {
+            stopThreadPool(pool);
+            return 1;
+        }
+        pool->threadCount++;
+    }
+    return 0;
+}
+
+void runOnThreadPool(ThreadPool *pool, void (*task)(void *taskArg, int threadIndex), void *taskArg)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->taskArg = taskArg;
+    pool->pending = pool->threadCount - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->workReady);
+    pthread_mutex_unlock(&pool->lock);
+
+    task(taskArg, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+    {
+        pthread_cond_wait(&pool->workDone, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void stopThreadPool(ThreadPool *pool)
+{
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->workReady);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 1; i < pool->threadCount; i++)
+    {
+        pthread_join(pool->workers[i - 1].thread, NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->workReady);
+    pthread_cond_destroy(&pool->workDone);
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->threadCount = 1;
+}
+
+void assignPoints(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int n, int d, KMeansState *state)
+{
+    AssignJob job;
+    double *partialSums;
+    int *partialQtys;
+    int t;
+    int j;
+
+    prepareAssignment(dataPoints, centroids, k, n, d, state);
+    job.dataPoints = dataPoints;
+    job.centroids = centroids;
+    job.k = k;
+    job.n = n;
+    job.d = d;
+    job.state = state;
+    if (state->deterministic)
+    {
+        if (state->threadCount > 1)
+        {
+            runOnThreadPool(state->pool, chunkedAssignTask, &job);
+        }
+        else
+        {
+            chunkedAssignTask(&job, 0);
+        }
+        reduceChunkSums(clusterSums, clusterQtys, k, d, state);
+    }
+    else if (state->threadCount == 1)
+    {
+        assignRange(dataPoints, centroids, clusterSums, clusterQtys, k, 0, n, d, state, 0);
+    }
+    else
+    {
+        runOnThreadPool(state->pool, assignTask, &job);
+
+        /* merge the private accumulators in thread order*/
+        for (t = 0; t < state->threadCount; t++)
+        {
+            getAccumulators(state, t, k, d, &partialSums, &partialQtys);
+            for (j = 0; j < k * d; j++)
+            {
+                clusterSums[j] += partialSums[j];
+            }
+            for (j = 0; j < k; j++)
+            {
+                clusterQtys[j] += partialQtys[j];
+            }
+        }
+    }
+    if (state->countedLabels != NULL)
+    {
+        applyLabelChanges(dataPoints, clusterSums, clusterQtys, k, n, d, state);
+    }
+    state->boundsReady = 1;
+}
+
+void getAccumulators(KMeansState *state, int index, int k, int d, double **sums, int **qtys)
+{
+    *sums = (double *)(state->accumulators + index * state->accumulatorStride);
+    *qtys = (int *)(*sums + k * d);
+}
+
+void assignTask(void *taskArg, int threadIndex)
+{
+    AssignJob *job = (AssignJob *)taskArg;
+    KMeansState *state = job->state;
+    double *threadSums;
+    int *threadQtys;
+    /* contiguous chunk of points of this thread*/
+    int first = (int)((long)job->n * threadIndex / state->threadCount);
+    int last = (int)((long)job->n * (threadIndex + 1) / state->threadCount);
+
+    if (threadIndex >= state->threadCount)
+    {
+        return; /* a shared pool may have more threads than this state uses*/
+    }
+    getAccumulators(state, threadIndex, job->k, job->d, &threadSums, &threadQtys);
+    clearClusters(threadSums, threadQtys, job->k, job->d);
+    assignRange(job->dataPoints, job->centroids, threadSums, threadQtys, job->k, first, last, job->d, state, threadIndex);
+}
+
+void chunkedAssignTask(void *taskArg, int threadIndex)
+{
+    AssignJob *job = (AssignJob *)taskArg;
+    KMeansState *state = job->state;
+    double *chunkSums;
+    int *chunkQtys;
+    int chunk;
+    int first;
+    int last;
+
+    /* chunk boundaries only depend on n, threads just pick chunks in turn*/
+    if (threadIndex >= state->threadCount)
+    {
+        return;
+    }
+    for (chunk = threadIndex; chunk < state->chunkCount; chunk += state->threadCount)
+    {
+        first = (int)((long)job->n * chunk / state->chunkCount);
+        last = (int)((long)job->n * (chunk + 1) / state->chunkCount);
+        getAccumulators(state, chunk, job->k, job->d, &chunkSums, &chunkQtys);
+        clearClusters(chunkSums, chunkQtys, job->k, job->d);
+        assignRange(job->dataPoints, job->centroids, chunkSums, chunkQtys, job->k, first, last, job->d, state, threadIndex);
+    }
+}
+
+void reduceChunkSums(double *clusterSums, int *clusterQtys, int k, int d, KMeansState *state)
+{
+    double *leftSums;
+    double *rightSums;
+    int *leftQtys;
+    int *rightQtys;
+    int width;
+    int chunk;
+    int j;
+
+    /* pairwise tree: chunk i takes chunk i + width for width = 1, 2, 4, ...*/
+    for (width = 1; width < state->chunkCount; width *= 2)
+    {
+        for (chunk = 0; chunk + width < state->chunkCount; chunk += 2 * width)
+        {
+            getAccumulators(state, chunk, k, d, &leftSums, &leftQtys);
+            getAccumulators(state, chunk + width, k, d, &rightSums, &rightQtys);
+            for (j = 0; j < k * d; j++)
+            {
+                leftSums[j] += rightSums[j];
+            }
+            for (j = 0; j < k; j++)
+            {
+                leftQtys[j] += rightQtys[j];
+            }
+        }
+    }
+    getAccumulators(state, 0, k, d, &leftSums, &leftQtys);
+    for (j = 0; j < k * d; j++)
+    {
+        clusterSums[j] += leftSums[j];
+    }
+    for (j = 0; j < k; j++)
+    {
+        clusterQtys[j] += leftQtys[j];
+    }
+}
+
+void assignRange(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, KMeansState *state, int threadIndex)
+{
+    if (state->singleCentroids != NULL)
+    {
+        computeClusterSumsSingle(state->singlePoints, state->singleCentroids, clusterSums, clusterQtys, k, first, last, d, state->labels);
+        return;
+    }
+    if (state->blockedPoints != NULL)
+    {
+        computeClusterSumsBlocked(dataPoints, state->blockedPoints, centroids, clusterSums, clusterQtys, k, first, last, d, state->labels);
+        return;
+    }
+    switch (state->algorithm)
+    {
+    case ALGORITHM_ELKAN:
+        computeClusterSumsElkan(dataPoints, centroids, clusterSums, clusterQtys, k, first, last, d, state);
+        break;
+    case ALGORITHM_HAMERLY:
+        computeClusterSumsHamerly(dataPoints, centroids, clusterSums, clusterQtys, k, first, last, d, state);
+        break;
+    case ALGORITHM_YINYANG:
+        computeClusterSumsYinyang(dataPoints, centroids, clusterSums, clusterQtys, k, first, last, d, state,
+                                  &state->oldGroupBounds[threadIndex * state->groupCount]);
+        break;
+    case ALGORITHM_GEMM:
+        computeClusterSumsGemm(dataPoints, centroids, clusterSums, clusterQtys, k, first, last, d, state,
+                               &state->gemmDots[(size_t)threadIndex * (GEMM_POINT_BLOCK * GEMM_CENTROID_BLOCK + GEMM_POINT_BLOCK)],
+                               &state->gemmClosest[threadIndex * GEMM_POINT_BLOCK]);
+        break;
+    case ALGORITHM_KDTREE:
+        computeClusterSumsKdTree(dataPoints, centroids, clusterSums, clusterQtys, k, first, last, d, state,
+                                 &state->kdCandidates[(size_t)threadIndex * (KDTREE_MAX_DEPTH + 2) * k],
+                                 &state->kdMidpoints[(size_t)threadIndex * d]);
+        break;
+    default:
+        if (state->countedLabels != NULL)
+        {
+            computeLabels(dataPoints, centroids, state->labels, k, first, last, d);
+            break;
+        }
+        computeClusterSums(dataPoints + (size_t)first * d, centroids, clusterSums, clusterQtys, k, last - first, d,
+                           state->labels != NULL ? state->labels + first : NULL);
+        break;
+    }
+}
+
+void prepareAssignment(double *dataPoints, double *centroids, int k, int n, int d, KMeansState *state)
+{
+    int c;
+    int g;
+    if (state->singleCentroids != NULL)
+    {
+        for (c = 0; c < k * d; c++)
+        {
+            state->singleCentroids[c] = (float)centroids[c];
+        }
+        return;
+    }
+    if (state->blockedPoints != NULL)
+    {
+        if (!state->boundsReady)
+        {
+            /* packed once, or again for every batch or chunk of new points*/
+            packPointBlocks(dataPoints, state->blockedPoints, n, d);
+        }
+        return;
+    }
+    if (state->algorithm == ALGORITHM_GEMM)
+    {
+        prepareGemm(dataPoints, centroids, k, n, d, state);
+        return;
+    }
+    if (state->algorithm == ALGORITHM_KDTREE)
+    {
+        if (!state->boundsReady)
+        {
+            /* the points never change, so the tree and its sums are built once*/
+            buildKdTree(dataPoints, n, d, state);
+        }
+        return;
+    }
+    if (!state->boundsReady)
+    {
+        if (state->algorithm == ALGORITHM_YINYANG)
+        {
+            groupCentroids(centroids, k, d, state);
+        }
+        return;
+    }
+    if (state->algorithm == ALGORITHM_ELKAN || state->algorithm == ALGORITHM_HAMERLY)
+    {
+        computeCentroidDists(centroids, k, d, state);
+    }
+    if (state->algorithm == ALGORITHM_HAMERLY)
+    {
+        state->maxDelta = 0;
+        state->secondDelta = 0;
+        state->maxDeltaCentroid = 0;
+        for (c = 0; c < k; c++)
+        {
+            if (state->centroidDeltas[c] > state->maxDelta)
+            {
+                state->secondDelta = state->maxDelta;
+                state->maxDelta = state->centroidDeltas[c];
+                state->maxDeltaCentroid = c;
+            }
+            else if (state->centroidDeltas[c] > state->secondDelta)
+            {
+                state->secondDelta = state->centroidDeltas[c];
+            }
+        }
+    }
+    if (state->algorithm == ALGORITHM_YINYANG)
+    {
+        for (g = 0; g < state->groupCount; g++)
+        {
+            state->groupDeltas[g] = 0;
+        }
+        for (c = 0; c < k; c++)
+        {
+            if (state->centroidDeltas[c] > state->groupDeltas[state->centroidGroups[c]])
+            {
+                state->groupDeltas[state->centroidGroups[c]] = state->centroidDeltas[c];
+            }
+        }
+    }
+}
+
+void accumulateClusterSums(double *dataPoints, int *labels, double *clusterSums, int *clusterQtys, int n, int d)
+{
+    double *clusterSumsCursor;
+    double *vecEnd;
+    int i;
+    /* points are added in index order, exactly like computeClusterSums does*/
+    for (i = 0; i < n; i++)
+    {
+        clusterQtys[labels[i]]++;
+        clusterSumsCursor = &clusterSums[labels[i] * d];
+        for (vecEnd = dataPoints + d; dataPoints < vecEnd; dataPoints++)
+        {
+            *(clusterSumsCursor++) += *dataPoints;
+        }
+    }
+}
+
+void computeLabels(double *dataPoints, double *centroids, int *labels, int k, int first, int last, int d)
+{
+    double *vec;
+    double minDist;
+    double dist;
+    int closest;
+    int i;
+    int c;
+    if (d <= fixedDimLimit)
+    {
+        fixedDimClusterSums[d](dataPoints + (size_t)first * d, centroids, NULL, NULL, k, last - first, d, labels + first);
+        return;
+    }
+    for (i = first, vec = dataPoints + (size_t)first * d; i < last; i++, vec += d)
+    {
+        closest = 0;
+        minDist = sqDist(vec, centroids, d);
+        for (c = 1; c < k; c++)
+        {
+            dist = sqDist(vec, &centroids[c * d], d);
+            if (dist < minDist)
+            {
+                minDist = dist;
+                closest = c;
+            }
+        }
+        labels[i] = closest;
+    }
+}
+
+void applyLabelChanges(double *dataPoints, double *clusterSums, int *clusterQtys, int k, int n, int d, KMeansState *state)
+{
+    double *vec;
+    double *oldSum;
+    double *newSum;
+    int oldLabel;
+    int newLabel;
+    int moved = 0;
+    int i;
+    int j;
+    /* serial and in index order, so the kept sums do not depend on the thread count*/
+    for (i = 0; i < n; i++)
+    {
+        oldLabel = state->countedLabels[i];
+        newLabel = state->labels[i];
+        if (oldLabel == newLabel)
+        {
+            continue;
+        }
+        vec = &dataPoints[(size_t)i * d];
+        newSum = &state->incrementalSums[newLabel * d];
+        if (oldLabel >= 0)
+        {
+            oldSum = &state->incrementalSums[oldLabel * d];
+            for (j = 0; j < d; j++)
+            {
+                oldSum[j] -= vec[j];
+            }
+            state->incrementalQtys[oldLabel]--;
+        }
+        for (j = 0; j < d; j++)
+        {
+            newSum[j] += vec[j];
+        }
+        state->incrementalQtys[newLabel]++;
+        state->countedLabels[i] = newLabel;
+        moved++;
+    }
+    state->movedPoints = moved;
+    for (j = 0; j < k * d; j++)
+    {
+        clusterSums[j] += state->incrementalSums[j];
+    }
+    for (j = 0; j < k; j++)
+    {
+        clusterQtys[j] += state->incrementalQtys[j];
+    }
+}
+
+void computeCentroidDists(double *centroids, int k, int d, KMeansState *state)
+{
+    double halfDist;
+    int i;
+    int j;
+    for (i = 0; i < k; i++)
+    {
+        state->halfMinDists[i] = HUGE_VAL;
+    }
+    for (i = 0; i < k; i++)
+    {
+        if (state->halfCentroidDists != NULL)
+        {
+            state->halfCentroidDists[i * k + i] = 0;
+        }
+        for (j = i + 1; j < k; j++)
+        {
+            halfDist = eucDist(&centroids[i * d], &centroids[j * d], d) / 2;
+            if (state->halfCentroidDists != NULL)
+            {
+                state->halfCentroidDists[i * k + j] = halfDist;
+                state->halfCentroidDists[j * k + i] = halfDist;
+            }
+            if (halfDist < state->halfMinDists[i])
+            {
+                state->halfMinDists[i] = halfDist;
+            }
+            if (halfDist < state->halfMinDists[j])
+            {
+                state->halfMinDists[j] = halfDist;
+            }
+        }
+    }
+}
+
+int canSkipCentroid(double bound, double upper, int centroid, int closest)
+{
+    return bound > upper || (bound == upper && centroid > closest);
+}
+
+void computeClusterSumsElkan(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, KMeansState *state)
+{
+    double *vec;
+    double *lower;       /* lower bounds of the current point*/
+    double upper;        /* upper bound of the current point*/
+    double minDistSq;    /* exact squared distance to closest, valid once upperTight*/
+    double distSq;
+    int upperTight;      /* true iff upper is the exact distance to closest*/
+    int closest;
+    int i;
+    int c;
+
+    for (i = first, vec = dataPoints + (size_t)first * d; i < last; i++, vec += d)
+    {
+        lower = &state->lowerBounds[(size_t)i * k];
+        if (!state->boundsReady)
+        {
+            /* first iteration, every distance is computed and becomes a tight bound*/
+            closest = 0;
+            minDistSq = sqDist(vec, centroids, d);
+            lower[0] = sqrt(minDistSq);
+            for (c = 1; c < k; c++)
+            {
+                distSq = sqDist(vec, &centroids[c * d], d);
+                lower[c] = sqrt(distSq);
+                if (distSq < minDistSq)
+                {
+                    minDistSq = distSq;
+                    closest = c;
+                }
+            }
+            state->labels[i] = closest;
+            state->upperBounds[i] = lower[closest];
+            continue;
+        }
+
+        /* move the bounds by how far the centroids moved in the last update*/
+        closest = state->labels[i];
+        upper = state->upperBounds[i] + state->centroidDeltas[closest];
+        for (c = 0; c < k; c++)
+        {
+            lower[c] -= state->centroidDeltas[c];
+            if (lower[c] < 0)
+            {
+                lower[c] = 0;
+            }
+        }
+        if (upper < state->halfMinDists[closest])
+        {
+            /* every other centroid is farther than closest*/
+            state->upperBounds[i] = upper;
+            continue;
+        }
+
+        upperTight = 0;
+        minDistSq = 0;
+        for (c = 0; c < k; c++)
+        {
+            if (c == closest || canSkipCentroid(lower[c], upper, c, closest) ||
+                canSkipCentroid(state->halfCentroidDists[closest * k + c], upper, c, closest))
+            {
+                continue;
+            }
+            if (!upperTight)
+            {
+                minDistSq = sqDist(vec, &centroids[closest * d], d);
+                upper = sqrt(minDistSq);
+                lower[closest] = upper;
+                upperTight = 1;
+                if (canSkipCentroid(lower[c], upper, c, closest) ||
+                    canSkipCentroid(state->halfCentroidDists[closest * k + c], upper, c, closest))
+                {
+                    continue;
+                }
+            }
+            distSq = sqDist(vec, &centroids[c * d], d);
+            lower[c] = sqrt(distSq);
+            if (distSq < minDistSq || (distSq == minDistSq && c < closest))
+            {
+                minDistSq = distSq;
+                closest = c;
+                upper = lower[c];
+            }
+        }
+        state->labels[i] = closest;
+        state->upperBounds[i] = upper;
+    }
+    if (state->countedLabels == NULL)
+    {
+        accumulateClusterSums(dataPoints + (size_t)first * d, state->labels + first, clusterSums, clusterQtys, last - first, d);
+    }
+}
+
+void computeClusterSumsHamerly(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, KMeansState *state)
+{
+    double *vec;
+    double upper;
+    double lower;
+    double bound;          /* max of lower and the half distance to the closest other centroid*/
+    double minDistSq;
+    double secondDistSq;
+    double distSq;
+    int closest;
+    int i;
+    int c;
+
+    for (i = first, vec = dataPoints + (size_t)first * d; i < last; i++, vec += d)
+    {
+        if (state->boundsReady)
+        {
+            closest = state->labels[i];
+            upper = state->upperBounds[i] + state->centroidDeltas[closest];
+            lower = state->lowerBounds[i] - (closest == state->maxDeltaCentroid ? state->secondDelta : state->maxDelta);
+            bound = lower > state->halfMinDists[closest] ? lower : state->halfMinDists[closest];
+            if (upper < bound)
+            {
+                state->upperBounds[i] = upper;
+                state->lowerBounds[i] = lower;
+                continue;
+            }
+            upper = eucDist(vec, &centroids[closest * d], d);
+            if (upper < bound)
+            {
+                state->upperBounds[i] = upper;
+                state->lowerBounds[i] = lower;
+                continue;
+            }
+        }
+
+        /* full scan, keeping the closest and second closest centroids*/
+        closest = 0;
+        minDistSq = sqDist(vec, centroids, d);
+        secondDistSq = HUGE_VAL;
+        for (c = 1; c < k; c++)
+        {
+            distSq = sqDist(vec, &centroids[c * d], d);
+            if (distSq < minDistSq)
+            {
+                secondDistSq = minDistSq;
+                minDistSq = distSq;
+                closest = c;
+            }
+            else if (distSq < secondDistSq)
+            {
+                secondDistSq = distSq;
+            }
+        }
+        state->labels[i] = closest;
+        state->upperBounds[i] = sqrt(minDistSq);
+        state->lowerBounds[i] = sqrt(secondDistSq);
+    }
+    if (state->countedLabels == NULL)
+    {
+        accumulateClusterSums(dataPoints + (size_t)first * d, state->labels + first, clusterSums, clusterQtys, last - first, d);
+    }
+}
+
+void groupCentroids(double *centroids, int k, int d, KMeansState *state)
+{
+    int t = state->groupCount;
+    double *groupCenters;
+    double *groupSums;
+    int *groupSizes;
+    double distSq;
+    double minDistSq;
+    int round;
+    int g;
+    int c;
+    int j;
+
+    groupCenters = (double *)malloc((size_t)t * d * sizeof(double));
+    groupSums = (double *)malloc((size_t)t * d * sizeof(double));
+    groupSizes = (int *)malloc(t * sizeof(int));
+    for (c = 0; c < k; c++)
+    {
+        /* contiguous index ranges, also the fallback if there is no memory for clustering*/
+        state->centroidGroups[c] = (int)((long)c * t / k);
+    }
+    if (groupCenters != NULL && groupSums != NULL && groupSizes != NULL)
+    {
+        for (g = 0; g < t; g++)
+        {
+            memcpy(&groupCenters[g * d], &centroids[(int)((long)g * k / t) * d], d * sizeof(double));
+        }
+        for (round = 0; round < YINYANG_GROUPING_ROUNDS; round++)
+        {
+            for (c = 0; c < k; c++)
+            {
+                minDistSq = HUGE_VAL;
+                for (g = 0; g < t; g++)
+                {
+                    distSq = sqDist(&centroids[c * d], &groupCenters[g * d], d);
+                    if (distSq < minDistSq)
+                    {
+                        minDistSq = distSq;
+                        state->centroidGroups[c] = g;
+                    }
+                }
+            }
+            clearClusters(groupSums, groupSizes, t, d);
+            for (c = 0; c < k; c++)
+            {
+                g = state->centroidGroups[c];
+                groupSizes[g]++;
+                for (j = 0; j < d; j++)
+                {
+                    groupSums[g * d + j] += centroids[c * d + j];
+                }
+            }
+            for (g = 0; g < t; g++)
+            {
+                /* an empty group keeps its previous center*/
+                for (j = 0; groupSizes[g] > 0 && j < d; j++)
+                {
+                    groupCenters[g * d + j] = groupSums[g * d + j] / groupSizes[g];
+                }
+            }
+        }
+    }
+    free(groupCenters);
+    free(groupSums);
+    free(groupSizes);
+
+    /* list the members of every group in index order*/
+    for (g = 0; g <= t; g++)
+    {
+        state->groupStarts[g] = 0;
+    }
+    for (c = 0; c < k; c++)
+    {
+        state->groupStarts[state->centroidGroups[c] + 1]++;
+    }
+    for (g = 0; g < t; g++)
+    {
+        state->groupStarts[g + 1] += state->groupStarts[g];
+    }
+    for (c = 0; c < k; c++)
+    {
+        state->groupMembers[state->groupStarts[state->centroidGroups[c]]++] = c;
+    }
+    for (g = t; g > 0; g--)
+    {
+        state->groupStarts[g] = state->groupStarts[g - 1];
+    }
+    state->groupStarts[0] = 0;
+}
+
+void computeClusterSumsYinyang(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, KMeansState *state, double *oldLower)
+{
+    int t = state->groupCount;
+    double *vec;
+    double *lower;             /* group lower bounds of the current point*/
+    double upper;              /* exact distance to closest once tightened*/
+    double globalLower;        /* smallest group lower bound*/
+    double groupLower;         /* new lower bound of the group being scanned*/
+    double oldClosestDist;
+    double minDistSq;
+    double distSq;
+    double dist;
+    int *groups = state->centroidGroups;
+    int oldClosest;
+    int closest;
+    int i;
+    int g;
+    int m;
+    int c;
+
+    for (i = first, vec = dataPoints + (size_t)first * d; i < last; i++, vec += d)
+    {
+        lower = &state->lowerBounds[(size_t)i * t];
+        if (!state->boundsReady)
+        {
+            /* first iteration, full scan. Every non closest distance goes into its group bound*/
+            for (g = 0; g < t; g++)
+            {
+                lower[g] = HUGE_VAL;
+            }
+            closest = 0;
+            minDistSq = sqDist(vec, centroids, d);
+            for (c = 1; c < k; c++)
+            {
+                distSq = sqDist(vec, &centroids[c * d], d);
+                if (distSq < minDistSq)
+                {
+                    dist = sqrt(minDistSq);
+                    minDistSq = distSq;
+                    g = groups[closest];
+                    closest = c;
+                }
+                else
+                {
+                    dist = sqrt(distSq);
+                    g = groups[c];
+                }
+                if (dist < lower[g])
+                {
+                    lower[g] = dist;
+                }
+            }
+            state->labels[i] = closest;
+            state->upperBounds[i] = sqrt(minDistSq);
+            continue;
+        }
+
+        /* global filter: move the bounds and compare against the smallest group bound*/
+        closest = state->labels[i];
+        upper = state->upperBounds[i] + state->centroidDeltas[closest];
+        globalLower = HUGE_VAL;
+        for (g = 0; g < t; g++)
+        {
+            oldLower[g] = lower[g];
+            lower[g] -= state->groupDeltas[g];
+            if (lower[g] < globalLower)
+            {
+                globalLower = lower[g];
+            }
+        }
+        if (upper < globalLower)
+        {
+            state->upperBounds[i] = upper;
+            continue;
+        }
+        minDistSq = sqDist(vec, &centroids[closest * d], d);
+        upper = sqrt(minDistSq);
+        if (upper < globalLower)
+        {
+            state->upperBounds[i] = upper;
+            continue;
+        }
+
+        /* group filter, then local filter for the centroids of every remaining group*/
+        oldClosest = closest;
+        oldClosestDist = upper;
+        for (g = 0; g < t; g++)
+        {
+            if (lower[g] > upper)
+            {
+                continue;
+            }
+            groupLower = HUGE_VAL;
+            for (m = state->groupStarts[g]; m < state->groupStarts[g + 1]; m++)
+            {
+                c = state->groupMembers[m];
+                if (c == closest)
+                {
+                    continue;
+                }
+                if (c == oldClosest)
+                {
+                    /* old bounds do not cover the previous closest, but its distance is known*/
+                    dist = oldClosestDist;
+                }
+                else if (canSkipCentroid(oldLower[g] - state->centroidDeltas[c], upper, c, closest))
+                {
+                    dist = oldLower[g] - state->centroidDeltas[c];
+                }
+                else
+                {
+                    distSq = sqDist(vec, &centroids[c * d], d);
+                    dist = sqrt(distSq);
+                    if (distSq < minDistSq || (distSq == minDistSq && c < closest))
+                    {
+                        /* the replaced closest now bounds its own group*/
+                        if (groups[closest] == g)
+                        {
+                            groupLower = upper < groupLower ? upper : groupLower;
+                        }
+                        else if (upper < lower[groups[closest]])
+                        {
+                            lower[groups[closest]] = upper;
+                        }
+                        minDistSq = distSq;
+                        closest = c;
+                        upper = dist;
+                        continue;
+                    }
+                }
+                if (dist < groupLower)
+                {
+                    groupLower = dist;
+                }
+            }
+            lower[g] = groupLower;
+        }
+        state->labels[i] = closest;
+        state->upperBounds[i] = upper;
+    }
+    if (state->countedLabels == NULL)
+    {
+        accumulateClusterSums(dataPoints + (size_t)first * d, state->labels + first, clusterSums, clusterQtys, last - first, d);
+    }
+}
+
+void prepareGemm(double *dataPoints, double *centroids, int k, int n, int d, KMeansState *state)
+{
+    double *packedCursor;
+    int panelCount = (k + GEMM_NR - 1) / GEMM_NR;
+    int p;
+    int r;
+    int c;
+    int j;
+    int i;
+
+    if (!state->boundsReady)
+    {
+        /* the points never change, so their norms are computed once*/
+        for (i = 0; i < n; i++)
+        {
+            state->pointNorms[i] = 0;
+            for (j = 0; j < d; j++)
+            {
+                state->pointNorms[i] += dataPoints[(size_t)i * d + j] * dataPoints[(size_t)i * d + j];
+            }
+        }
+    }
+    for (c = 0; c < k; c++)
+    {
+        state->centroidNorms[c] = 0;
+        for (j = 0; j < d; j++)
+        {
+            state->centroidNorms[c] += centroids[c * d + j] * centroids[c * d + j];
+        }
+    }
+    /* pack GEMM_NR centroids per panel, coordinate after coordinate. Missing centroids of the last panel are 0*/
+    packedCursor = state->packedCentroids;
+    for (p = 0; p < panelCount; p++)
+    {
+        for (j = 0; j < d; j++)
+        {
+            for (r = 0; r < GEMM_NR; r++)
+            {
+                c = p * GEMM_NR + r;
+                *(packedCursor++) = c < k ? centroids[c * d + j] : 0;
+            }
+        }
+    }
+}
+
+void computeClusterSumsGemm(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, KMeansState *state, double *dots, int *closest)
+{
+    double *rows[GEMM_MR];   /* points of the current microkernel call*/
+    double *bestDists = dots + GEMM_POINT_BLOCK * GEMM_CENTROID_BLOCK;
+    double *clusterSumsCursor;
+    double *vec;
+    double pointNorm;
+    double dist;
+    int blockFirst;
+    int blockSize;
+    int centroidFirst;
+    int centroidCount;
+    int panelCount;
+    int depthFirst;
+    int depthLast;
+    int i;
+    int r;
+    int p;
+    int c;
+    int j;
+
+    (void)centroids; /* read through state->packedCentroids*/
+    for (blockFirst = first; blockFirst < last; blockFirst += GEMM_POINT_BLOCK)
+    {
+        blockSize = last - blockFirst < GEMM_POINT_BLOCK ? last - blockFirst : GEMM_POINT_BLOCK;
+        for (i = 0; i < blockSize; i++)
+        {
+            bestDists[i] = HUGE_VAL;
+            closest[i] = 0;
+        }
+        for (centroidFirst = 0; centroidFirst < k; centroidFirst += GEMM_CENTROID_BLOCK)
+        {
+            centroidCount = k - centroidFirst < GEMM_CENTROID_BLOCK ? k - centroidFirst : GEMM_CENTROID_BLOCK;
+            panelCount = (centroidCount + GEMM_NR - 1) / GEMM_NR;
+            for (i = 0; i < GEMM_POINT_BLOCK * GEMM_CENTROID_BLOCK; i++)
+            {
+                dots[i] = 0;
+            }
+            /* dots[i][c] = x_i . c_c for the whole block, one depth block at a time*/
+            for (depthFirst = 0; depthFirst < d; depthFirst += GEMM_DEPTH_BLOCK)
+            {
+                depthLast = d - depthFirst < GEMM_DEPTH_BLOCK ? d : depthFirst + GEMM_DEPTH_BLOCK;
+                for (i = 0; i < blockSize; i += GEMM_MR)
+                {
+                    /* a partial group repeats its last point, the extra rows are ignored*/
+                    for (r = 0; r < GEMM_MR; r++)
+                    {
+                        rows[r] = &dataPoints[(size_t)(blockFirst + (i + r < blockSize ? i + r : blockSize - 1)) * d];
+                    }
+                    for (p = 0; p < panelCount; p++)
+                    {
+                        gemmKernel(rows, &state->packedCentroids[((size_t)centroidFirst / GEMM_NR + p) * d * GEMM_NR],
+                                   depthFirst, depthLast, &dots[i * GEMM_CENTROID_BLOCK + p * GEMM_NR], GEMM_CENTROID_BLOCK);
+                    }
+                }
+            }
+            /* ||x - c||^2 = ||x||^2 - 2 x . c + ||c||^2, ties go to the lower index*/
+            for (i = 0; i < blockSize; i++)
+            {
+                pointNorm = state->pointNorms[blockFirst + i];
+                for (c = 0; c < centroidCount; c++)
+                {
+                    dist = pointNorm - 2 * dots[i * GEMM_CENTROID_BLOCK + c] + state->centroidNorms[centroidFirst + c];
+                    if (dist < bestDists[i])
+                    {
+                        bestDists[i] = dist;
+                        closest[i] = centroidFirst + c;
+                    }
+                }
+            }
+        }
+        for (i = 0; i < blockSize; i++)
+        {
+            vec = &dataPoints[(size_t)(blockFirst + i) * d];
+            if (state->labels != NULL)
+            {
+                state->labels[blockFirst + i] = closest[i];
+            }
+            clusterQtys[closest[i]]++;
+            clusterSumsCursor = &clusterSums[closest[i] * d];
+            for (j = 0; j < d; j++)
+            {
+                clusterSumsCursor[j] += vec[j];
+            }
+        }
+    }
+}
+
+void computeClusterSumsSingle(float *points, float *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, int *labels)
+{
+    float *vec;
+    float minDist;
+    float dist;
+    double *clusterSumsCursor;
+    int closestCluster;
+    int i;
+    int c;
+    int j;
+    for (i = first; i < last; i++)
+    {
+        vec = points + (size_t)i * d;
+        closestCluster = 0;
+        minDist = sqDistSingle(vec, centroids, d);
+        for (c = 1; c < k; c++)
+        {
+            dist = sqDistSingle(vec, centroids + c * d, d);
+            if (dist < minDist)
+            {
+                minDist = dist;
+                closestCluster = c;
+            }
+        }
+        if (labels != NULL)
+        {
+            labels[i] = closestCluster;
+        }
+        clusterQtys[closestCluster]++;
+        clusterSumsCursor = &clusterSums[closestCluster * d];
+        for (j = 0; j < d; j++)
+        {
+            clusterSumsCursor[j] += vec[j];
+        }
+    }
+}
+
+void initCentroidsSingle(float *points, double *centroids, int k, int d)
+{
+    int i;
+    for (i = 0; i < k * d; i++)
+    {
+        centroids[i] = points[i];
+    }
+}
+
+void buildKdTree(double *dataPoints, int n, int d, KMeansState *state)
+{
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        state->kdOrder[i] = i;
+    }
+    state->kdNodeCount = 0;
+    buildKdNode(dataPoints, 0, n, d, state);
+}
+
+int buildKdNode(double *dataPoints, int first, int last, int d, KMeansState *state)
+{
+    int node = state->kdNodeCount++;
+    double *cell = &state->kdCells[(size_t)node * 2 * d];
+    double *sum = &state->kdSums[(size_t)node * d];
+    double *leftCell;
+    double *rightCell;
+    double *vec;
+    double width;
+    double widest = -1;
+    int widestDim = 0;
+    int middle;
+    int left;
+    int right;
+    int i;
+    int j;
+
+    state->kdNodes[node].first = first;
+    state->kdNodes[node].last = last;
+    state->kdNodes[node].left = -1;
+    state->kdNodes[node].right = -1;
+    vec = &dataPoints[(size_t)state->kdOrder[first] * d];
+    for (j = 0; j < d; j++)
+    {
+        cell[j] = vec[j];
+        cell[d + j] = vec[j];
+        sum[j] = 0;
+    }
+    /* leaves scan their points, the first level also to find the widest coordinate*/
+    if (node == 0 || last - first <= KDTREE_LEAF_SIZE)
+    {
+        for (i = first; i < last; i++)
+        {
+            vec = &dataPoints[(size_t)state->kdOrder[i] * d];
+            for (j = 0; j < d; j++)
+            {
+                cell[j] = vec[j] < cell[j] ? vec[j] : cell[j];
+                cell[d + j] = vec[j] > cell[d + j] ? vec[j] : cell[d + j];
+                sum[j] += vec[j];
+            }
+        }
+        if (last - first <= KDTREE_LEAF_SIZE)
+        {
+            return node;
+        }
+    }
+    else
+    {
+        /* the box of an inner node is found from a sample while descending, its exact box and sum are merged from the children*/
+        for (i = first; i < last; i += (last - first) / KDTREE_LEAF_SIZE)
+        {
+            vec = &dataPoints[(size_t)state->kdOrder[i] * d];
+            for (j = 0; j < d; j++)
+            {
+                cell[j] = vec[j] < cell[j] ? vec[j] : cell[j];
+                cell[d + j] = vec[j] > cell[d + j] ? vec[j] : cell[d + j];
+            }
+        }
+    }
+
+    for (j = 0; j < d; j++)
+    {
+        width = cell[d + j] - cell[j];
+        if (width > widest)
+        {
+            widest = width;
+            widestDim = j;
+        }
+    }
+    middle = first + (last - first) / 2;
+    selectKdMedian(dataPoints, state->kdOrder, first, last, middle, widestDim, d);
+    left = buildKdNode(dataPoints, first, middle, d, state);
+    right = buildKdNode(dataPoints, middle, last, d, state);
+    state->kdNodes[node].left = left;
+    state->kdNodes[node].right = right;
+    leftCell = &state->kdCells[(size_t)left * 2 * d];
+    rightCell = &state->kdCells[(size_t)right * 2 * d];
+    for (j = 0; j < d; j++)
+    {
+        cell[j] = leftCell[j] < rightCell[j] ? leftCell[j] : rightCell[j];
+        cell[d + j] = leftCell[d + j] > rightCell[d + j] ? leftCell[d + j] : rightCell[d + j];
+        sum[j] = state->kdSums[(size_t)left * d + j] + state->kdSums[(size_t)right * d + j];
+    }
+    return node;
+}
+
+void selectKdMedian(double *dataPoints, int *order, int first, int last, int nth, int dim, int d)
+{
+    double pivot;
+    int low = first;
+    int high = last - 1;
+    int i;
+    int j;
+    int swap;
+    while (low < high)
+    {
+        pivot = dataPoints[(size_t)order[low + (high - low) / 2] * d + dim];
+        i = low;
+        j = high;
+        while (i <= j)
+        {
+            while (dataPoints[(size_t)order[i] * d + dim] < pivot)
+            {
+                i++;
+            }
+            while (dataPoints[(size_t)order[j] * d + dim] > pivot)
+            {
+                j--;
+            }
+            if (i <= j)
+            {
+                swap = order[i];
+                order[i++] = order[j];
+                order[j--] = swap;
+            }
+        }
+        if (nth <= j)
+        {
+            high = j;
+        }
+        else if (nth >= i)
+        {
+            low = i;
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+int canPruneKdCandidate(double *centroids, int candidate, int best, double *cell, int d)
+{
+    double *candidateCentroid = &centroids[candidate * d];
+    double *bestCentroid = &centroids[best * d];
+    double corner;
+    double diff;
+    double candidateDist = 0;
+    double bestDist = 0;
+    int j;
+    for (j = 0; j < d; j++)
+    {
+        corner = candidateCentroid[j] > bestCentroid[j] ? cell[d + j] : cell[j];
+        diff = candidateCentroid[j] - corner;
+        candidateDist += diff * diff;
+        diff = bestCentroid[j] - corner;
+        bestDist += diff * diff;
+    }
+    return candidateDist > bestDist || (candidateDist == bestDist && candidate > best);
+}
+
+void filterKdNode(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d,
+                  KMeansState *state, int node, int *candidates, int candidateCount, int *scratch, double *midpoint)
+{
+    KdNode *kdNode = &state->kdNodes[node];
+    double *cell = &state->kdCells[(size_t)node * 2 * d];
+    double *sum;
+    double *vec;
+    double dist;
+    double minDist;
+    int best;
+    int kept = 0;
+    int i;
+    int c;
+    int j;
+
+    if (kdNode->last <= first || kdNode->first >= last)
+    {
+        return;
+    }
+    if (candidateCount > 1)
+    {
+        /* the candidate closest to the middle of the cell prunes the others*/
+        for (j = 0; j < d; j++)
+        {
+            midpoint[j] = (cell[j] + cell[d + j]) / 2;
+        }
+        best = candidates[0];
+        minDist = sqDist(midpoint, &centroids[best * d], d);
+        for (c = 1; c < candidateCount; c++)
+        {
+            dist = sqDist(midpoint, &centroids[candidates[c] * d], d);
+            if (dist < minDist)
+            {
+                minDist = dist;
+                best = candidates[c];
+            }
+        }
+        for (c = 0; c < candidateCount; c++)
+        {
+            if (candidates[c] == best || !canPruneKdCandidate(centroids, candidates[c], best, cell, d))
+            {
+                scratch[kept++] = candidates[c];
+            }
+        }
+        candidates = scratch;
+        candidateCount = kept;
+        scratch += k;
+    }
+
+    if (candidateCount == 1 && kdNode->first >= first && kdNode->last <= last)
+    {
+        /* every point of the node is closest to the same centroid*/
+        sum = &state->kdSums[(size_t)node * d];
+        clusterQtys[candidates[0]] += kdNode->last - kdNode->first;
+        for (i = kdNode->first; state->labels != NULL && i < kdNode->last; i++)
+        {
+            state->labels[state->kdOrder[i]] = candidates[0];
+        }
+        for (j = 0; j < d; j++)
+        {
+            clusterSums[candidates[0] * d + j] += sum[j];
+        }
+        return;
+    }
+    if (kdNode->left >= 0)
+    {
+        filterKdNode(dataPoints, centroids, clusterSums, clusterQtys, k, first, last, d, state, kdNode->left, candidates, candidateCount, scratch, midpoint);
+        filterKdNode(dataPoints, centroids, clusterSums, clusterQtys, k, first, last, d, state, kdNode->right, candidates, candidateCount, scratch, midpoint);
+        return;
+    }
+
+    /* candidates are in increasing order, so ties go to the lower index like in updateClusters*/
+    for (i = kdNode->first < first ? first : kdNode->first; i < kdNode->last && i < last; i++)
+    {
+        vec = &dataPoints[(size_t)state->kdOrder[i] * d];
+        best = candidates[0];
+        minDist = sqDist(vec, &centroids[best * d], d);
+        for (c = 1; c < candidateCount; c++)
+        {
+            dist = sqDist(vec, &centroids[candidates[c] * d], d);
+            if (dist < minDist)
+            {
+                minDist = dist;
+                best = candidates[c];
+            }
+        }
+        if (state->labels != NULL)
+        {
+            state->labels[state->kdOrder[i]] = best;
+        }
+        clusterQtys[best]++;
+        for (j = 0; j < d; j++)
+        {
+            clusterSums[best * d + j] += vec[j];
+        }
+    }
+}
+
+void computeClusterSumsKdTree(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d,
+                              KMeansState *state, int *candidates, double *midpoint)
+{
+    int c;
+    for (c = 0; c < k; c++)
+    {
+        candidates[c] = c;
+    }
+    filterKdNode(dataPoints, centroids, clusterSums, clusterQtys, k, first, last, d, state, 0, candidates, k, candidates + k, midpoint);
+}
+
+void packPointBlocks(double *dataPoints, double *blockedPoints, int n, int d)
+{
+    int blockFirst;
+    int i;
+    int j;
+    int l;
+    for (blockFirst = 0; blockFirst < n; blockFirst += POINT_BLOCK_LANES)
+    {
+        for (j = 0; j < d; j++)
+        {
+            for (l = 0; l < POINT_BLOCK_LANES; l++)
+            {
+                i = blockFirst + l < n ? blockFirst + l : n - 1;
+                *(blockedPoints++) = dataPoints[(size_t)i * d + j];
+            }
+        }
+    }
+}
+
+void computeClusterSumsBlocked(double *dataPoints, double *blockedPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int first, int last, int d, int *labels)
+{
+    int closest[POINT_BLOCK_LANES];
+    double *vec;
+    double *clusterSumsCursor;
+    int blockFirst;
+    int i;
+    int c;
+    int j;
+    /* first may fall inside a block, whose other points belong to another range*/
+    for (blockFirst = first - first % POINT_BLOCK_LANES; blockFirst < last; blockFirst += POINT_BLOCK_LANES)
+    {
+        blockAssign(&blockedPoints[(size_t)blockFirst * d], centroids, k, d, closest);
+        for (i = blockFirst < first ? first : blockFirst; i < blockFirst + POINT_BLOCK_LANES && i < last; i++)
+        {
+            c = closest[i - blockFirst];
+            if (labels != NULL)
+            {
+                labels[i] = c;
+            }
+            clusterQtys[c]++;
+            vec = &dataPoints[(size_t)i * d];
+            clusterSumsCursor = &clusterSums[c * d];
+            for (j = 0; j < d; j++)
+            {
+                clusterSumsCursor[j] += vec[j];
+            }
+        }
+    }
+}
+
+unsigned long nextRandom(unsigned long *rngState)
+{
+    unsigned long x = *rngState;
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    *rngState = x;
+    return x;
+}
+
+double nextRandomUnit(unsigned long *rngState)
+{
+    unsigned long high = nextRandom(rngState) >> 5; /* 27 bits*/
+    unsigned long low = nextRandom(rngState) >> 6;  /* 26 bits*/
+    return (high * 67108864.0 + low) / 9007199254740992.0;
+}
+
+unsigned long mixSeed(unsigned long x)
+{
+    x &= 0xffffffffUL;
+    x ^= x >> 16;
+    x = (x * 0x85ebca6bUL) & 0xffffffffUL;
+    x ^= x >> 13;
+    x = (x * 0xc2b2ae35UL) & 0xffffffffUL;
+    x ^= x >> 16;
+    return x != 0 ? x : 0x9e3779b9UL; /* xorshift never leaves 0*/
+}
+
+double sqDistMixed(float *point, double *centroid, int d)
+{
+    double dist = 0;
+    double diff;
+    int j;
+    for (j = 0; j < d; j++)
+    {
+        diff = point[j] - centroid[j];
+        dist += diff * diff;
+    }
+    return dist;
+}
+
+double pointSqDist(double *dataPoints, float *singlePoints, int i, double *centroid, int d)
+{
+    if (singlePoints != NULL)
+    {
+        return sqDistMixed(&singlePoints[(size_t)i * d], centroid, d);
+    }
+    return d <= fixedDimLimit ? fixedDimSqDist[d](&dataPoints[(size_t)i * d], centroid, d) : sqDist(&dataPoints[(size_t)i * d], centroid, d);
+}
+
+void seedKMeansPlusPlus(double *dataPoints, float *singlePoints, double *centroids, int *choices, double *minDists, double *weights, int k, int n, int d, unsigned long seed, ThreadPool *pool, FitSignals *signals)
+{
+    SeedJob job;
+    unsigned long rngState;
+    double total;
+    double target;
+    double weight;
+    int chosen;
+    int picked;
+    int c;
+    int i;
+    int j;
+
+    rngState = (seed ^ 0xc2b2ae35UL) & 0xffffffffUL;
+    if (rngState == 0)
+    {
+        rngState = 0xc2b2ae35UL; /* xorshift never leaves 0*/
+    }
+    job.dataPoints = dataPoints;
+    job.singlePoints = singlePoints;
+    job.minDists = minDists;
+    job.weights = weights;
+    job.chunkCount = DETERMINISTIC_CHUNKS < n ? DETERMINISTIC_CHUNKS : n;
+    job.threadCount = pool != NULL ? pool->threadCount : 1;
+    job.n = n;
+    job.d = d;
+
+    picked = (int)(nextRandomUnit(&rngState) * n);
+    if (weights != NULL)
+    {
+        total = 0;
+        for (i = 0; i < n; i++)
+        {
+            total += weights[i];
+        }
+        target = nextRandomUnit(&rngState) * total;
+        for (i = 0; i < n; i++)
+        {
+            if (weights[i] > 0)
+            {
+                picked = i;
+                if (target < weights[i])
+                {
+                    break;
+                }
+                target -= weights[i];
+            }
+        }
+    }
+    for (chosen = 0; chosen < k; chosen++)
+    {
+        for (j = 0; j < d; j++)
+        {
+            centroids[chosen * d + j] = singlePoints != NULL ? singlePoints[(size_t)picked * d + j] : dataPoints[(size_t)picked * d + j];
+        }
+        if (choices != NULL)
+        {
+            choices[chosen] = picked;
+        }
+        if (chosen == k - 1)
+        {
+            break;
+        }
+
+        job.centroid = &centroids[chosen * d];
+        job.firstCentroid = chosen == 0;
+        if (pool != NULL)
+        {
+            runOnThreadPool(pool, seedTask, &job);
+        }
+        else
+        {
+            seedTask(&job, 0);
+        }
+        if (fitInterrupted(signals))
+        {
+            return;
+        }
+
+        /* chunk sums are added in chunk order, then the target is found in its chunk by a running prefix sum*/
+        total = 0;
+        for (c = 0; c < job.chunkCount; c++)
+        {
+            total += job.chunkSums[c];
+        }
+        if (total <= 0)
+        {
+            /* every point is on a centroid already, so any one will do*/
+            picked = (int)(nextRandomUnit(&rngState) * n);
+            continue;
+        }
+        target = nextRandomUnit(&rngState) * total;
+        for (c = 0; c < job.chunkCount - 1 && target >= job.chunkSums[c]; c++)
+        {
+            target -= job.chunkSums[c];
+        }
+        picked = -1;
+        for (i = (int)((long)c * n / job.chunkCount); i < (int)((long)(c + 1) * n / job.chunkCount); i++)
+        {
+            weight = weights != NULL ? weights[i] * minDists[i] : minDists[i];
+            if (weight > 0)
+            {
+                picked = i; /* rounding may leave target just above the chunk sum, then its last candidate is taken*/
+                if (target < weight)
+                {
+                    break;
+                }
+                target -= weight;
+            }
+        }
+        if (picked < 0)
+        {
+            picked = (int)(nextRandomUnit(&rngState) * n);
+        }
+    }
+}
+
+void seedTask(void *taskArg, int threadIndex)
+{
+    SeedJob *job = (SeedJob *)taskArg;
+    double sum;
+    double dist;
+    int first;
+    int last;
+    int c;
+    int i;
+    for (c = threadIndex; c < job->chunkCount; c += job->threadCount)
+    {
+        first = (int)((long)c * job->n / job->chunkCount);
+        last = (int)((long)(c + 1) * job->n / job->chunkCount);
+        sum = 0;
+        for (i = first; i < last; i++)
+        {
+            dist = pointSqDist(job->dataPoints, job->singlePoints, i, job->centroid, job->d);
+            if (job->firstCentroid || dist < job->minDists[i])
+            {
+                job->minDists[i] = dist;
+            }
+            sum += job->weights != NULL ? job->weights[i] * job->minDists[i] : job->minDists[i];
+        }
+        job->chunkSums[c] = sum;
+    }
+}
+
+int initFromName(char *name)
+{
+    if (strcmp(name, "first") == 0)
+    {
+        return INIT_FIRST;
+    }
+    if (strcmp(name, "kmeans++") == 0)
+    {
+        return INIT_KMEANS_PP;
+    }
+    if (strcmp(name, "kmeans||") == 0)
+    {
+        return INIT_KMEANS_PARALLEL;
+    }
+    if (strcmp(name, "afkmc2") == 0)
+    {
+        return INIT_AFKMC2;
+    }
+    return -1;
+}
+
+void seedAfkMc2(double *dataPoints, float *singlePoints, double *centroids, int *choices, double *proposal, int k, int n, int d, int chainLength, unsigned long seed, ThreadPool *pool, FitSignals *signals)
+{
+    SeedJob job;
+    unsigned long rngState = mixSeed(seed ^ 0x165667b1UL);
+    double total;
+    double running;
+    double pointDist;
+    double candidateDist;
+    double pointWeight;
+    double candidateWeight;
+    int point;
+    int candidate;
+    int chosen;
+    int step;
+    int c;
+    int i;
+    int j;
+
+    point = (int)(nextRandomUnit(&rngState) * n);
+    for (j = 0; j < d; j++)
+    {
+        centroids[j] = singlePoints != NULL ? singlePoints[(size_t)point * d + j] : dataPoints[(size_t)point * d + j];
+    }
+    if (choices != NULL)
+    {
+        choices[0] = point;
+    }
+
+    /* the only pass over the points: distances to the first centroid, like the first k-means++ update*/
+    job.dataPoints = dataPoints;
+    job.singlePoints = singlePoints;
+    job.centroid = centroids;
+    job.minDists = proposal;
+    job.weights = NULL;
+    job.firstCentroid = 1;
+    job.chunkCount = DETERMINISTIC_CHUNKS < n ? DETERMINISTIC_CHUNKS : n;
+    job.threadCount = pool != NULL ? pool->threadCount : 1;
+    job.n = n;
+    job.d = d;
+    if (pool != NULL)
+    {
+        runOnThreadPool(pool, seedTask, &job);
+    }
+    else
+    {
+        seedTask(&job, 0);
+    }
+    total = 0;
+    for (c = 0; c < job.chunkCount; c++)
+    {
+        total += job.chunkSums[c];
+    }
+    /* half of q follows the distances and half is uniform, all uniform when every point is on the first centroid*/
+    running = 0;
+    for (i = 0; i < n; i++)
+    {
+        running += total > 0 ? 0.5 * proposal[i] / total + 0.5 / n : 1.0 / n;
+        proposal[i] = running;
+    }
+
+    for (chosen = 1; chosen < k && !fitInterrupted(signals); chosen++)
+    {
+        point = sampleProposal(proposal, n, &rngState);
+        pointDist = closestSqDist(dataPoints, singlePoints, point, centroids, chosen, d);
+        pointWeight = proposal[point] - (point > 0 ? proposal[point - 1] : 0);
+        for (step = 1; step < chainLength; step++)
+        {
+            candidate = sampleProposal(proposal, n, &rngState);
+            candidateDist = closestSqDist(dataPoints, singlePoints, candidate, centroids, chosen, d);
+            candidateWeight = proposal[candidate] - (candidate > 0 ? proposal[candidate - 1] : 0);
+            /* accept with probability min(1, (candidateDist / candidateWeight) / (pointDist / pointWeight))*/
+            if (pointDist == 0 || candidateDist * pointWeight > nextRandomUnit(&rngState) * pointDist * candidateWeight)
+            {
+                point = candidate;
+                pointDist = candidateDist;
+                pointWeight = candidateWeight;
+            }
+        }
+        for (j = 0; j < d; j++)
+        {
+            centroids[chosen * d + j] = singlePoints != NULL ? singlePoints[(size_t)point * d + j] : dataPoints[(size_t)point * d + j];
+        }
+        if (choices != NULL)
+        {
+            choices[chosen] = point;
+        }
+    }
+}
+
+int sampleProposal(double *proposal, int n, unsigned long *rngState)
+{
+    double target = nextRandomUnit(rngState) * proposal[n - 1];
+    int low = 0;
+    int high = n - 1;
+    int middle;
+    /* the first point whose running sum passes target*/
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (proposal[middle] > target)
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+double closestSqDist(double *dataPoints, float *singlePoints, int i, double *centroids, int count, int d)
+{
+    double best = pointSqDist(dataPoints, singlePoints, i, centroids, d);
+    double dist;
+    int c;
+    for (c = 1; c < count; c++)
+    {
+        dist = pointSqDist(dataPoints, singlePoints, i, &centroids[c * d], d);
+        if (dist < best)
+        {
+            best = dist;
+        }
+    }
+    return best;
+}
+
+void layoutParallelSeeding(ParallelSeeding *seeding, Arena *arena, int k, int n, int d)
+{
+    /* rounds sample KMEANS_PARALLEL_OVERSAMPLING * k points each on average, twice that is kept room for*/
+    seeding->capacity = 1 + 2 * KMEANS_PARALLEL_ROUNDS * KMEANS_PARALLEL_OVERSAMPLING * k;
+    seeding->capacity = seeding->capacity < n ? seeding->capacity : n;
+    seeding->minDists = (double *)arenaAlloc(arena, (size_t)n * sizeof(double));
+    seeding->closest = (int *)arenaAlloc(arena, (size_t)n * sizeof(int));
+    seeding->sampled = (unsigned char *)arenaAlloc(arena, (size_t)n);
+    seeding->candidateIndices = (int *)arenaAlloc(arena, seeding->capacity * sizeof(int));
+    seeding->candidates = (double *)arenaAlloc(arena, (size_t)seeding->capacity * d * sizeof(double));
+    seeding->weights = (double *)arenaAlloc(arena, seeding->capacity * sizeof(double));
+    seeding->candidateDists = (double *)arenaAlloc(arena, seeding->capacity * sizeof(double));
+    seeding->candidateChoices = (int *)arenaAlloc(arena, k * sizeof(int));
+}
+
+void seedKMeansParallel(double *dataPoints, float *singlePoints, double *centroids, int *choices, ParallelSeeding *seeding, int k, int n, int d, unsigned long seed, ThreadPool *pool, FitSignals *signals)
+{
+    ParallelSeedJob job;
+    unsigned long rngState = mixSeed(seed ^ 0x27d4eb2fUL);
+    int added;
+    int roundFirst;
+    int roundEnd;
+    int c;
+    int i;
+    int j;
+
+    job.dataPoints = dataPoints;
+    job.singlePoints = singlePoints;
+    job.seeding = seeding;
+    job.oversampling = (double)KMEANS_PARALLEL_OVERSAMPLING * k;
+    job.seed = nextRandom(&rngState);
+    job.chunkCount = DETERMINISTIC_CHUNKS < n ? DETERMINISTIC_CHUNKS : n;
+    job.threadCount = pool != NULL ? pool->threadCount : 1;
+    job.n = n;
+    job.d = d;
+    memset(seeding->sampled, 0, n);
+
+    /* the candidates start with one uniform point*/
+    i = (int)(nextRandomUnit(&rngState) * n);
+    seeding->sampled[i] = 1;
+    seeding->candidateIndices[0] = i;
+    job.firstCandidate = 0;
+    job.candidateCount = 1;
+    for (job.round = 0;; job.round++)
+    {
+        for (c = job.firstCandidate; c < job.candidateCount; c++)
+        {
+            i = seeding->candidateIndices[c];
+            for (j = 0; j < d; j++)
+            {
+                seeding->candidates[c * d + j] = singlePoints != NULL ? singlePoints[(size_t)i * d + j] : dataPoints[(size_t)i * d + j];
+            }
+        }
+        /* in increasing slices, which keeps the lower candidate on ties like a single pass*/
+        roundFirst = job.firstCandidate;
+        roundEnd = job.candidateCount;
+        for (; job.firstCandidate < roundEnd && !fitInterrupted(signals); job.firstCandidate = job.candidateCount)
+        {
+            job.candidateCount = roundEnd - job.firstCandidate > KMEANS_PARALLEL_SLICE ? job.firstCandidate + KMEANS_PARALLEL_SLICE : roundEnd;
+            if (pool != NULL)
+            {
+                runOnThreadPool(pool, parallelUpdateTask, &job);
+            }
+            else
+            {
+                parallelUpdateTask(&job, 0);
+            }
+        }
+        job.firstCandidate = roundFirst;
+        job.candidateCount = roundEnd;
+        if (fitInterrupted(signals))
+        {
+            return;
+        }
+        job.cost = 0;
+        for (c = 0; c < job.chunkCount; c++)
+        {
+            job.cost += job.chunkSums[c];
+        }
+        /* rounds go on while there are fewer candidates than centroids, up to four times as many*/
+        if (job.cost <= 0 || job.candidateCount == seeding->capacity || job.round >= 4 * KMEANS_PARALLEL_ROUNDS ||
+            (job.round >= KMEANS_PARALLEL_ROUNDS && job.candidateCount >= k))
+        {
+            break;
+        }
+
+        if (pool != NULL)
+        {
+            runOnThreadPool(pool, parallelSampleTask, &job);
+        }
+        else
+        {
+            parallelSampleTask(&job, 0);
+        }
+        /* new candidates are taken in point order, so they do not depend on the threads.
+           Points already among the candidates have a distance of 0 and are never sampled again*/
+        job.firstCandidate = job.candidateCount;
+        for (i = 0; i < n && job.candidateCount < seeding->capacity; i++)
+        {
+            if (seeding->sampled[i] && seeding->minDists[i] > 0)
+            {
+                seeding->candidateIndices[job.candidateCount++] = i;
+            }
+        }
+    }
+
+    /* fewer than k distinct points: any other points fill the candidates up*/
+    added = job.candidateCount;
+    for (i = 0; i < n && job.candidateCount < k; i++)
+    {
+        if (!seeding->sampled[i])
+        {
+            seeding->sampled[i] = 1;
+            seeding->candidateIndices[job.candidateCount++] = i;
+        }
+    }
+    for (c = 0; c < job.candidateCount; c++)
+    {
+        if (c >= added)
+        {
+            i = seeding->candidateIndices[c];
+            for (j = 0; j < d; j++)
+            {
+                seeding->candidates[c * d + j] = singlePoints != NULL ? singlePoints[(size_t)i * d + j] : dataPoints[(size_t)i * d + j];
+            }
+        }
+        seeding->weights[c] = c >= added ? 1 : 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        seeding->weights[seeding->closest[i]]++;
+    }
+
+    seedKMeansPlusPlus(seeding->candidates, NULL, centroids, seeding->candidateChoices, seeding->candidateDists, seeding->weights,
+                       k, job.candidateCount, d, nextRandom(&rngState), pool, signals);
+    /* an interrupted k-means++ leaves candidateChoices unset*/
+    if (choices != NULL && !fitInterrupted(signals))
+    {
+        for (c = 0; c < k; c++)
+        {
+            choices[c] = seeding->candidateIndices[seeding->candidateChoices[c]];
+        }
+    }
+}
+
+void parallelSampleTask(void *taskArg, int threadIndex)
+{
+    ParallelSeedJob *job = (ParallelSeedJob *)taskArg;
+    unsigned long rngState;
+    double scale = job->oversampling / job->cost;
+    int first;
+    int last;
+    int c;
+    int i;
+    for (c = threadIndex; c < job->chunkCount; c += job->threadCount)
+    {
+        /* every chunk draws from its own generator, so the samples do not depend on which thread runs it*/
+        rngState = mixSeed(job->seed + 0x9e3779b9UL * (unsigned long)(job->round * DETERMINISTIC_CHUNKS + c + 1));
+        first = (int)((long)c * job->n / job->chunkCount);
+        last = (int)((long)(c + 1) * job->n / job->chunkCount);
+        for (i = first; i < last; i++)
+        {
+            if (nextRandomUnit(&rngState) < scale * job->seeding->minDists[i])
+            {
+                job->seeding->sampled[i] = 1;
+            }
+        }
+    }
+}
+
+void parallelUpdateTask(void *taskArg, int threadIndex)
+{
+    ParallelSeedJob *job = (ParallelSeedJob *)taskArg;
+    ParallelSeeding *seeding = job->seeding;
+    double sum;
+    double dist;
+    int first;
+    int last;
+    int c;
+    int i;
+    int j;
+    for (c = threadIndex; c < job->chunkCount; c += job->threadCount)
+    {
+        first = (int)((long)c * job->n / job->chunkCount);
+        last = (int)((long)(c + 1) * job->n / job->chunkCount);
+        sum = 0;
+        for (i = first; i < last; i++)
+        {
+            for (j = job->firstCandidate; j < job->candidateCount; j++)
+            {
+                dist = pointSqDist(job->dataPoints, job->singlePoints, i, &seeding->candidates[j * job->d], job->d);
+                if (j == 0 || dist < seeding->minDists[i])
+                {
+                    seeding->minDists[i] = dist;
+                    seeding->closest[i] = j;
+                }
+            }
+            sum += seeding->minDists[i];
+        }
+        job->chunkSums[c] = sum;
+    }
+}
+
+void sampleBatch(double *dataPoints, double *batch, int n, int d, int batchSize, unsigned long *rngState)
+{
+    int i;
+    for (i = 0; i < batchSize; i++)
+    {
+        memcpy(&batch[(size_t)i * d], &dataPoints[(size_t)(nextRandom(rngState) % n) * d], d * sizeof(double));
+    }
+}
+
+double updateCentroidsMiniBatch(double *centroids, double *clusterSums, int *clusterQtys, long *centroidCounts, int k, int d, double *centroidDeltas)
+{
+    double maxDelta = 0;
+    double rate;
+    double step;
+    double sqDelta;
+    int c;
+    int j;
+    for (c = 0; c < k; c++)
+    {
+        centroidDeltas[c] = 0;
+        if (clusterQtys[c] == 0)
+        {
+            continue; /* no points in this batch, the centroid stays*/
+        }
+        centroidCounts[c] += clusterQtys[c];
+        rate = (double)clusterQtys[c] / centroidCounts[c];
+        sqDelta = 0;
+        for (j = 0; j < d; j++)
+        {
+            step = rate * (clusterSums[c * d + j] / clusterQtys[c] - centroids[c * d + j]);
+            centroids[c * d + j] += step;
+            sqDelta += step * step;
+        }
+        centroidDeltas[c] = sqrt(sqDelta);
+        if (centroidDeltas[c] > maxDelta)
+        {
+            maxDelta = centroidDeltas[c];
+        }
+    }
+    clearClusters(clusterSums, clusterQtys, k, d);
+    return maxDelta;
+}
+
+void miniBatchKMeans(double *dataPoints, Workspace *ws, int k, int n, int d, int iter, double epsilon, KMeansOptions *options)
+{
+    unsigned long rngState;
+    double smoothing; /* weight of the newest step in the moving average of the movement*/
+    double movement;
+    double averageMovement = 0;
+    int batchSize = options->batchSize < n ? options->batchSize : n;
+    int i;
+
+    rngState = (options->seed ^ 0x9e3779b9UL) & 0xffffffffUL;
+    if (rngState == 0)
+    {
+        rngState = 0x9e3779b9UL; /* xorshift never leaves 0*/
+    }
+    smoothing = 2.0 * batchSize / (n + 1.0);
+    if (smoothing > 1)
+    {
+        smoothing = 1;
+    }
+
+    for (i = 0; i < iter; i++)
+    {
+        sampleBatch(dataPoints, ws->batch, n, d, batchSize, &rngState);
+        ws->state.boundsReady = 0; /* new points, GEMM recomputes their norms*/
+        assignPoints(ws->batch, ws->centroids, ws->clusterSums, ws->clusterQtys, k, batchSize, d, &ws->state);
+        movement = updateCentroidsMiniBatch(ws->centroids, ws->clusterSums, ws->clusterQtys, ws->centroidCounts, k, d, ws->state.centroidDeltas);
+        averageMovement = i == 0 ? movement : smoothing * movement + (1 - smoothing) * averageMovement;
+        if (averageMovement < epsilon || fitInterrupted(options->signals))
+        {
+            break;
+        }
+    }
+}
+
+int setupWorkspace(Workspace *workspaces, int workspaceCount, Arena *arena, KMeansOptions *options, int k, int n, int d, int iter, int copyPoints)
+{
+    Workspace *ws;
+    KMeansOptions stateOptions;
+    int batchSize = options->batchSize < n ? options->batchSize : n;
+    int pass;
+    int w;
+
+    stateOptions = *options;
+    /* bounds would only describe the points of a single batch, so bound based algorithms run as Lloyd*/
+    if (options->batchSize > 0 && stateOptions.algorithm != ALGORITHM_GEMM)
+    {
+        stateOptions.algorithm = ALGORITHM_LLOYD;
+    }
+    stateOptions.threadCount = options->threadCount / workspaceCount > 1 ? options->threadCount / workspaceCount : 1;
+    /* the first pass only counts bytes, the second lays the buffers out in the mapping*/
+    for (pass = 0; pass < 2; pass++)
+    {
+        if (pass == 0)
+        {
+            arenaStartSizing(arena);
+        }
+        else if (arenaReserve(arena, options->hugePages))
+        {
+            return 1;
+        }
+        for (w = 0; w < workspaceCount; w++)
+        {
+            ws = &workspaces[w];
+            ws->stateOptions = stateOptions;
+            if (w == 0)
+            {
+                ws->dataPoints = copyPoints && !options->singlePrecision ? (double *)arenaAlloc(arena, (size_t)n * d * sizeof(double)) : NULL;
+                ws->singlePoints = copyPoints && options->singlePrecision ? (float *)arenaAlloc(arena, (size_t)n * d * sizeof(float)) : NULL;
+            }
+            else
+            {
+                ws->dataPoints = workspaces[0].dataPoints;
+                ws->singlePoints = workspaces[0].singlePoints;
+            }
+            ws->centroids = (double *)arenaAlloc(arena, k * d * sizeof(double));
+            ws->clusterSums = (double *)arenaAllocZeroed(arena, k * d * sizeof(double));
+            ws->clusterQtys = (int *)arenaAllocZeroed(arena, k * sizeof(int));
+            ws->batch = NULL;
+            ws->centroidCounts = NULL;
+            ws->initialCentroids = NULL;
+            ws->bestCentroids = NULL;
+            if (options->batchSize > 0)
+            {
+                ws->batch = (double *)arenaAlloc(arena, (size_t)batchSize * d * sizeof(double));
+                ws->centroidCounts = (long *)arenaAllocZeroed(arena, k * sizeof(long));
+            }
+            if (options->restarts > 1 && w == 0)
+            {
+                ws->initialCentroids = (double *)arenaAlloc(arena, (size_t)options->restarts * k * d * sizeof(double));
+                ws->bestCentroids = (double *)arenaAlloc(arena, k * d * sizeof(double));
+            }
+            ws->trace.inertias = NULL;
+            ws->trace.shifts = NULL;
+            ws->trace.iterations = 0;
+            ws->bestTrace = ws->trace;
+            ws->bestLabels = NULL;
+            if (options->keepLabels)
+            {
+                /* KMeans always runs at least one assignment step*/
+                ws->trace.inertias = (double *)arenaAlloc(arena, (iter > 1 ? iter : 1) * sizeof(double));
+                ws->trace.shifts = (double *)arenaAlloc(arena, (iter > 1 ? iter : 1) * sizeof(double));
+                if (options->restarts > 1 && w == 0)
+                {
+                    ws->bestTrace.inertias = (double *)arenaAlloc(arena, (iter > 1 ? iter : 1) * sizeof(double));
+                    ws->bestTrace.shifts = (double *)arenaAlloc(arena, (iter > 1 ? iter : 1) * sizeof(double));
+                    ws->bestLabels = (int *)arenaAlloc(arena, n * sizeof(int));
+                }
+            }
+            if (initKMeansState(&ws->state, &ws->stateOptions, k, options->batchSize > 0 ? batchSize : n, d, arena))
+            {
+                /* stop the threads of the workspaces set up so far*/
+                while (--w >= 0)
+                {
+                    freeKMeansState(&workspaces[w].state);
+                }
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void KMeans(int k, int n, int d, int iter, double *dataPoints, float *singlePoints, double epsilon, Workspace *ws, KMeansOptions *options)
+{
+    int i; /* for counting algorithm iterations */
+    int done;
+
+    if (options->batchSize > 0)
+    {
+        miniBatchKMeans(dataPoints, ws, k, n, d, iter, epsilon, options);
+        return;
+    }
+    ws->state.singlePoints = singlePoints;
+    ws->trace.iterations = 0;
+    i = 0;
+    do
+    {
+        assignPoints(dataPoints, ws->centroids, ws->clusterSums, ws->clusterQtys, k, n, d, &ws->state);
+        traceAssignment(&ws->trace, dataPoints, singlePoints, ws->centroids, ws->state.labels, n, d);
+        /* in incremental mode no moved point means the centroids are already final*/
+        done = ++i >= iter || ws->state.movedPoints == 0;
+        if (!done)
+        {
+            if (options->keepEmptyClusters)
+            {
+                fillEmptyClusters(ws->centroids, ws->clusterSums, ws->clusterQtys, k, d);
+            }
+            done = updateCentroids(ws->centroids, ws->clusterSums, ws->clusterQtys, k, d, epsilon, ws->state.centroidDeltas);
+            traceUpdate(&ws->trace, ws->state.centroidDeltas, k);
+            done = done || fitInterrupted(options->signals);
+        }
+    } while (!done);
+}
+
+void fillEmptyClusters(double *centroids, double *clusterSums, int *clusterQtys, int k, int d)
+{
+    int c;
+    int j;
+
+    for (c = 0; c < k; c++)
+    {
+        if (clusterQtys[c] != 0)
+        {
+            continue;
+        }
+        for (j = 0; j < d; j++)
+        {
+            clusterSums[c * d + j] = centroids[c * d + j];
+        }
+        clusterQtys[c] = 1;
+    }
+}
+
+void traceAssignment(FitTrace *trace, double *dataPoints, float *singlePoints, double *centroids, int *labels, int n, int d)
+{
+    double inertia = 0;
+    int i;
+
+    if (trace->inertias == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        inertia += pointSqDist(dataPoints, singlePoints, i, &centroids[(size_t)labels[i] * d], d);
+    }
+    trace->inertias[trace->iterations] = inertia;
+    trace->shifts[trace->iterations] = 0;
+    trace->iterations++;
+}
+
+void traceUpdate(FitTrace *trace, double *centroidDeltas, int k)
+{
+    double shift = 0;
+    int c;
+
+    if (trace->inertias == NULL)
+    {
+        return;
+    }
+    for (c = 0; c < k; c++)
+    {
+        shift = centroidDeltas[c] > shift ? centroidDeltas[c] : shift;
+    }
+    trace->shifts[trace->iterations - 1] = shift;
+}
+
+int restartWorkers(KMeansOptions *options)
+{
+    int workers = options->restarts < options->threadCount ? options->restarts : options->threadCount;
+    return workers < RESTART_MAX_WORKERS ? workers : RESTART_MAX_WORKERS;
+}
+
+void seedRandomCentroids(double *dataPoints, float *singlePoints, double *centroids, int count, int k, int n, int d, unsigned long seed)
+{
+    unsigned long rngState;
+    double *centroidsCursor = centroids;
+    int chosen;
+    int set;
+    int i;
+    int j;
+
+    rngState = (seed ^ 0x85ebca6bUL) & 0xffffffffUL;
+    if (rngState == 0)
+    {
+        rngState = 0x85ebca6bUL; /* xorshift never leaves 0*/
+    }
+    for (set = 0; set < count; set++)
+    {
+        /* selection sampling: point i is taken with probability (k - chosen) / (n - i), which picks exactly k*/
+        chosen = 0;
+        for (i = 0; i < n && chosen < k; i++)
+        {
+            if ((int)(nextRandom(&rngState) % (unsigned long)(n - i)) >= k - chosen)
+            {
+                continue;
+            }
+            for (j = 0; j < d; j++)
+            {
+                *(centroidsCursor++) = singlePoints != NULL ? singlePoints[(size_t)i * d + j] : dataPoints[(size_t)i * d + j];
+            }
+            chosen++;
+        }
+    }
+}
+
+double computeInertia(double *dataPoints, float *singlePoints, double *centroids, int k, int n, int d)
+{
+    double inertia = 0;
+    double best;
+    double dist;
+    int i;
+    int c;
+    for (i = 0; i < n; i++)
+    {
+        best = -1;
+        for (c = 0; c < k; c++)
+        {
+            dist = pointSqDist(dataPoints, singlePoints, i, &centroids[c * d], d);
+            if (best < 0 || dist < best)
+            {
+                best = dist;
+            }
+        }
+        inertia += best;
+    }
+    return inertia;
+}
+
+int runRestarts(double *dataPoints, float *singlePoints, Workspace *workspaces, int workerCount, int k, int n, int d, int iter, double epsilon, KMeansOptions *options)
+{
+    RestartJob job;
+    ThreadPool pool;
+    int failed = 0;
+
+    job.dataPoints = dataPoints;
+    job.singlePoints = singlePoints;
+    job.k = k;
+    job.n = n;
+    job.d = d;
+    job.iter = iter;
+    job.epsilon = epsilon;
+    job.options = options;
+    job.workspaces = workspaces;
+    job.workerCount = workerCount;
+    job.bestInertia = 0;
+    job.bestRestart = -1;
+    pthread_mutex_init(&job.lock, NULL);
+    if (workerCount == 1)
+    {
+        restartTask(&job, 0);
+    }
+    else if (startThreadPool(&pool, workerCount))
+    {
+        failed = 1;
+    }
+    else
+    {
+        runOnThreadPool(&pool, restartTask, &job);
+        stopThreadPool(&pool);
+    }
+    pthread_mutex_destroy(&job.lock);
+    if (!failed)
+    {
+        memcpy(workspaces[0].centroids, workspaces[0].bestCentroids, k * d * sizeof(double));
+    }
+    return failed;
+}
+
+void restartTask(void *taskArg, int threadIndex)
+{
+    RestartJob *job = (RestartJob *)taskArg;
+    Workspace *ws = &job->workspaces[threadIndex];
+    KMeansOptions restartOptions = *job->options;
+    int k = job->k;
+    int n = job->n;
+    int d = job->d;
+    double inertia;
+    int r;
+
+    /* restart r always runs in workspace r % workerCount, so restart 0 runs first in the first one*/
+    for (r = threadIndex; r < job->options->restarts; r += job->workerCount)
+    {
+        memcpy(ws->centroids, job->workspaces[0].initialCentroids + (size_t)r * k * d, k * d * sizeof(double));
+        clearClusters(ws->clusterSums, ws->clusterQtys, k, d);
+        if (ws->centroidCounts != NULL)
+        {
+            memset(ws->centroidCounts, 0, k * sizeof(long));
+        }
+        restartKMeansState(&ws->state, k, n, d);
+        restartOptions.seed = job->options->seed + r; /* every restart samples its own mini-batches*/
+        KMeans(k, n, d, job->iter, job->dataPoints, job->singlePoints, job->epsilon, ws, &restartOptions);
+        if (fitInterrupted(job->options->signals))
+        {
+            break;
+        }
+        inertia = computeInertia(job->dataPoints, job->singlePoints, ws->centroids, k, n, d);
+
+        pthread_mutex_lock(&job->lock);
+        /* ties go to the lower restart, so the result does not depend on the order restarts finish in*/
+        if (job->bestRestart < 0 || inertia < job->bestInertia || (inertia == job->bestInertia && r < job->bestRestart))
+        {
+            job->bestInertia = inertia;
+            job->bestRestart = r;
+            memcpy(job->workspaces[0].bestCentroids, ws->centroids, k * d * sizeof(double));
+            if (job->workspaces[0].bestLabels != NULL)
+            {
+                memcpy(job->workspaces[0].bestLabels, ws->state.labels, n * sizeof(int));
+                memcpy(job->workspaces[0].bestTrace.inertias, ws->trace.inertias, ws->trace.iterations * sizeof(double));
+                memcpy(job->workspaces[0].bestTrace.shifts, ws->trace.shifts, ws->trace.iterations * sizeof(double));
+                job->workspaces[0].bestTrace.iterations = ws->trace.iterations;
+            }
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+void initFitSignals(FitSignals *signals)
+{
+    signals->caller = pthread_self();
+    signals->nextCheck = 0;
+    signals->interrupted = 0;
+    pthread_mutex_init(&signals->lock, NULL);
+}
+
+int fitInterrupted(FitSignals *signals)
+{
+    struct timespec now;
+    PyGILState_STATE gil;
+    int interrupted;
+
+    if (signals == NULL)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&signals->lock);
+    interrupted = signals->interrupted;
+    pthread_mutex_unlock(&signals->lock);
+    if (interrupted || !pthread_equal(pthread_self(), signals->caller))
+    {
+        return interrupted;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec + now.tv_nsec * 1e-9 < signals->nextCheck)
+    {
+        return 0;
+    }
+    signals->nextCheck = now.tv_sec + now.tv_nsec * 1e-9 + SIGNAL_CHECK_INTERVAL;
+    gil = PyGILState_Ensure();
+    interrupted = PyErr_CheckSignals() != 0;
+    PyGILState_Release(gil);
+    if (interrupted)
+    {
+        pthread_mutex_lock(&signals->lock);
+        signals->interrupted = 1;
+        pthread_mutex_unlock(&signals->lock);
+    }
+    return interrupted;
+}
+
+Arena *acquireFitArena(Arena *local)
+{
+    if (pthread_mutex_trylock(&fitArenaLock) == 0)
+    {
+        return &fitArena;
+    }
+    arenaInit(local);
+    return local;
+}
+
+void releaseFit(Workspace *workspaces, int workspaceCount, Arena *arena, Py_buffer *view)
+{
+    int w;
+    for (w = 0; w < workspaceCount; w++)
+    {
+        freeKMeansState(&workspaces[w].state);
+    }
+    if (view != NULL)
+    {
+        PyBuffer_Release(view);
+    }
+    if (arena != &fitArena)
+    {
+        arenaRelease(arena);
+        return;
+    }
+    /* used still counts the bytes this fit laid out*/
+    if (arena->size > FIT_ARENA_KEEP_MAX || arena->size > FIT_ARENA_SLACK * arena->used)
+    {
+        arenaRelease(arena);
+    }
+    pthread_mutex_unlock(&fitArenaLock);
+}
+
+void freeModule(void *module)
+{
+    (void)module;
+    pthread_mutex_lock(&fitArenaLock);
+    arenaRelease(&fitArena);
+    pthread_mutex_unlock(&fitArenaLock);
+}
+
+char bufferElementType(Py_buffer *view)
+{
+    char *format = view->format != NULL ? view->format : "B";
+
+    /* native and standard sizes agree for float and double*/
+    if (*format == '@' || *format == '=')
+    {
+        format++;
+    }
+    if (strcmp(format, "d") == 0 && view->itemsize == sizeof(double))
+    {
+        return 'd';
+    }
+    if (strcmp(format, "f") == 0 && view->itemsize == sizeof(float))
+    {
+        return 'f';
+    }
+    return 0;
+}
+
+char getValuesBuffer(PyObject *values, Py_buffer *view, Py_ssize_t count)
+{
+    char type;
+
+    if (!PyObject_CheckBuffer(values))
+    {
+        return 0;
+    }
+    if (PyObject_GetBuffer(values, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0)
+    {
+        PyErr_Clear();
+        return 0;
+    }
+    type = bufferElementType(view);
+    if (type == 0 || view->len != count * view->itemsize)
+    {
+        PyBuffer_Release(view);
+        return 0;
+    }
+    return type;
+}
+
+Py_ssize_t countValues(PyObject *values)
+{
+    Py_buffer view;
+    Py_ssize_t count = -1;
+
+    if (PyList_Check(values))
+    {
+        return PyList_Size(values);
+    }
+    if (PyObject_CheckBuffer(values) && PyObject_GetBuffer(values, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0)
+    {
+        if (bufferElementType(&view) != 0)
+        {
+            count = view.len / view.itemsize;
+        }
+        PyBuffer_Release(&view);
+    }
+    PyErr_Clear();
+    return count;
+}
+
+int readValues(PyObject *values, double *doubles, float *singles, Py_ssize_t count)
+{
+    Py_buffer view;
+    char type;
+    double num;
+
+    type = getValuesBuffer(values, &view, count);
+    if (type != 0)
+    {
+        for (Py_ssize_t i = 0; i < count; i++)
+        {
+            num = type == 'd' ? ((double *)view.buf)[i] : ((float *)view.buf)[i];
+            if (doubles != NULL)
+            {
+                doubles[i] = num;
+            }
+            else
+            {
+                singles[i] = (float)num;
+            }
+        }
+        PyBuffer_Release(&view);
+        return 0;
+    }
+    if (!PyList_Check(values) || PyList_Size(values) != count)
+    {
+        return 1;
+    }
+    for (Py_ssize_t i = 0; i < count; i++)
+    {
+        num = PyFloat_AsDouble(PyList_GetItem(values, i));
+        if (num == -1 && PyErr_Occurred())
+        {
+            return 1;
+        }
+        if (doubles != NULL)
+        {
+            doubles[i] = num;
+        }
+        else
+        {
+            singles[i] = (float)num;
+        }
+    }
+    return 0;
+}
+
+PyObject *valuesToPython(void *values, Py_ssize_t count, char *format)
+{
+    PyObject *bytes;
+    PyObject *numpy;
+    PyObject *view;
+    PyObject *result;
+
+    bytes = PyByteArray_FromStringAndSize((char *)values, count * (Py_ssize_t)(strcmp(format, "d") == 0 ? sizeof(double) : sizeof(int)));
+    if (bytes == NULL)
+    {
+        return NULL;
+    }
+    numpy = PyImport_ImportModule("numpy");
+    if (numpy != NULL)
+    {
+        result = PyObject_CallMethod(numpy, "frombuffer", "Os", bytes, format);
+        Py_DECREF(numpy);
+    }
+    else
+    {
+        PyErr_Clear();
+        view = PyMemoryView_FromObject(bytes);
+        result = view != NULL ? PyObject_CallMethod(view, "cast", "s", format) : NULL;
+        Py_XDECREF(view);
+    }
+    Py_DECREF(bytes);
+    return result;
+}
+
+static PyObject *k_means_wrapper(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"k", "n", "d", "iter", "epsilon", "initialCentroids", "dataPoints", "algorithm", "n_threads", "deterministic", "batch_size", "seed", "float32", "layout", "incremental", "hugepages", "n_init", "full_output", NULL};
+    int k, n, d, iter;
+    PyObject *initialCentroids, *dataPoints;
+    Py_ssize_t initialCentroidsLength;
+    int initialSets; /* restarts whose initial centroids were given, the others start from random points*/
+    Py_ssize_t dataPointsLength;
+    PyObject *ret;
+    FitTrace *trace; /* full output: report of the fit returned*/
+    int *labels;
+    double *dataPointsArray = NULL;
+    float *singlePointsArray = NULL; /* the points in single precision mode, instead of dataPointsArray*/
+    Py_buffer view;
+    Py_buffer *viewUsed = NULL; /* &view iff the points are read in place from the buffer of dataPoints*/
+    char viewType;
+    double epsilon;
+    char *algorithmName = "lloyd";
+    char *layoutName = "rows";
+    KMeansOptions options;
+    Workspace workspaces[RESTART_MAX_WORKERS];
+    int workerCount;
+    double *centroidsArray; /* where the given initial centroids are copied to*/
+    Arena localArena;
+    Arena *arena;
+    FitSignals signals;
+    int failed = 0;
+
+    options.threadCount = 1;
+    options.deterministic = 0;
+    options.batchSize = 0;
+    options.seed = 0;
+    options.singlePrecision = 0;
+    options.incremental = 0;
+    options.hugePages = 0;
+    options.restarts = 1;
+    options.keepLabels = 0;
+    options.keepEmptyClusters = 0;
+    options.signals = NULL;
+    options.pool = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iiiidOO|$sipikpsppip", kwlist, &k, &n, &d, &iter, &epsilon,
+                                     &initialCentroids, &dataPoints, &algorithmName, &options.threadCount,
+                                     &options.deterministic, &options.batchSize, &options.seed, &options.singlePrecision,
+                                     &layoutName, &options.incremental, &options.hugePages, &options.restarts, &options.keepLabels))
+    {
+        PyErr_SetString(PyExc_ValueError, "");
+        return NULL;
+    }
+    options.algorithm = algorithmFromName(algorithmName);
+    options.blockedLayout = strcmp(layoutName, "blocked") == 0;
+    /* mini-batches and the blocked layout copy points as doubles, so they never run in single precision.
+       Incremental sums are kept per point, so they need all points as doubles in rows.
+       Mini-batches only assign the points of a batch, so they have no labels to report*/
+    if (n < 1 || options.algorithm < 0 || options.threadCount < 1 || options.batchSize < 0 || options.restarts < 1 ||
+        (options.keepLabels && options.batchSize > 0) ||
+        (!options.blockedLayout && strcmp(layoutName, "rows") != 0) ||
+        (options.singlePrecision && (options.batchSize > 0 || options.blockedLayout)) ||
+        (options.incremental && (options.batchSize > 0 || options.singlePrecision || options.blockedLayout)))
+    {
+        PyErr_SetString(PyExc_ValueError, "");
+        return NULL;
+    }
+    /* a C contiguous buffer of n * d values (a NumPy array, memoryview or np.memmap) is read in place:
+       float64 unless single precision was asked for, float32 whenever the points may be single.
+       Other buffers are converted into the workspace like lists*/
+    viewType = getValuesBuffer(dataPoints, &view, (Py_ssize_t)n * d);
+    if (viewType == 'd' && !options.singlePrecision)
+    {
+        viewUsed = &view;
+        dataPointsArray = (double *)view.buf;
+    }
+    else if (viewType == 'f' && options.batchSize == 0 && !options.blockedLayout && !options.incremental)
+    {
+        viewUsed = &view;
+        singlePointsArray = (float *)view.buf;
+        options.singlePrecision = 1;
+    }
+    else if (viewType != 0)
+    {
+        PyBuffer_Release(&view);
+    }
+    initialCentroidsLength = countValues(initialCentroids);
+    dataPointsLength = viewUsed != NULL ? (Py_ssize_t)n * d : countValues(dataPoints);
+    initialSets = k > 0 && d > 0 ? (int)(initialCentroidsLength / (k * d)) : 0;
+    workerCount = restartWorkers(&options);
+    arena = acquireFitArena(&localArena);
+    /* the workspace holds k initial centroids for the first or every restart and n points.
+       Restarts without given centroids pick k of the points*/
+    if ((initialCentroidsLength != k * d && initialCentroidsLength != options.restarts * k * d) ||
+        dataPointsLength != (Py_ssize_t)n * d || (initialSets < options.restarts && k > n) ||
+        setupWorkspace(workspaces, workerCount, arena, &options, k, n, d, iter, viewUsed == NULL))
+    {
+        releaseFit(workspaces, 0, arena, viewUsed);
+        PyErr_SetString(PyExc_ValueError, "");
+        return NULL;
+    }
+    if (viewUsed == NULL)
+    {
+        dataPointsArray = workspaces[0].dataPoints;
+        singlePointsArray = workspaces[0].singlePoints;
+    }
+    centroidsArray = options.restarts > 1 ? workspaces[0].initialCentroids : workspaces[0].centroids;
+    if (readValues(initialCentroids, centroidsArray, NULL, initialCentroidsLength) ||
+        (viewUsed == NULL && readValues(dataPoints, dataPointsArray, singlePointsArray, dataPointsLength)))
+    {
+        releaseFit(workspaces, workerCount, arena, viewUsed);
+        PyErr_SetString(PyExc_ValueError, "");
+        return NULL;
+    }
+
+    /* the points and centroids are owned by this call now (buffers stay exported until releaseFit),
+       so fits from other Python threads run meanwhile*/
+    initFitSignals(&signals);
+    options.signals = &signals;
+    Py_BEGIN_ALLOW_THREADS
+    if (options.restarts > 1)
+    {
+        seedRandomCentroids(dataPointsArray, singlePointsArray, centroidsArray + (size_t)initialSets * k * d,
+                            options.restarts - initialSets, k, n, d, options.seed);
+        failed = runRestarts(dataPointsArray, singlePointsArray, workspaces, workerCount, k, n, d, iter, epsilon, &options);
+    }
+    else
+    {
+        KMeans(k, n, d, iter, dataPointsArray, singlePointsArray, epsilon, &workspaces[0], &options);
+    }
+    Py_END_ALLOW_THREADS
+    pthread_mutex_destroy(&signals.lock);
+    if (failed || signals.interrupted)
+    {
+        releaseFit(workspaces, workerCount, arena, viewUsed);
+        /* an interrupted fit raises the exception of the signal handler*/
+        if (!signals.interrupted)
+        {
+            PyErr_SetString(PyExc_ValueError, "");
+        }
+        return NULL;
+    }
 
-double eucDist(double *vec1, double *vec2, int d)
+    /* return result to python, in full precision (kmeans_pp.py rounds when printing)*/
+    if (!options.keepLabels)
+    {
+        ret = valuesToPython(workspaces[0].centroids, (Py_ssize_t)k * d, "d");
+        releaseFit(workspaces, workerCount, arena, viewUsed);
+        return ret;
+    }
+    trace = options.restarts > 1 ? &workspaces[0].bestTrace : &workspaces[0].trace;
+    labels = options.restarts > 1 ? workspaces[0].bestLabels : workspaces[0].state.labels;
+    ret = Py_BuildValue("(NNdiNN)", valuesToPython(workspaces[0].centroids, (Py_ssize_t)k * d, "d"),
+                        valuesToPython(labels, n, "i"), trace->inertias[trace->iterations - 1], trace->iterations,
+                        valuesToPython(trace->inertias, trace->iterations, "d"), valuesToPython(trace->shifts, trace->iterations, "d"));
+    releaseFit(workspaces, workerCount, arena, viewUsed);
+    return ret;
+}
+
+int setupSeeding(Arena *arena, double **points, double **centroids, int **choices, double **minDists, ParallelSeeding *parallelSeeding, int k, int n, int d, int copyPoints)
 {
-    double *p1 = vec1;
-    double *p2 = vec2;
-    double distSquared = 0;
-    while (p1 < &vec1[d])
+    int pass;
+    /* the first pass only counts bytes, the second lays the buffers out in the mapping*/
+    for (pass = 0; pass < 2; pass++)
     {
-        distSquared += pow((*(p1++) - *(p2++)), 2);
+        if (pass == 0)
+        {
+            arenaStartSizing(arena);
+        }
+        else if (arenaReserve(arena, 0))
+        {
+            return 1;
+        }
+        *points = copyPoints ? (double *)arenaAlloc(arena, (size_t)n * d * sizeof(double)) : NULL;
+        *centroids = (double *)arenaAlloc(arena, (size_t)k * d * sizeof(double));
+        *choices = (int *)arenaAlloc(arena, k * sizeof(int));
+        *minDists = NULL;
+        if (parallelSeeding != NULL)
+        {
+            layoutParallelSeeding(parallelSeeding, arena, k, n, d);
+        }
+        else
+        {
+            *minDists = (double *)arenaAlloc(arena, (size_t)n * sizeof(double));
+        }
     }
-    return sqrt(distSquared);
+    return 0;
 }
 
-int updateCentroid(double *centroid, double *clusterSum, int clusterQty, int d, double epsilon)
+static PyObject *k_means_pp_wrapper(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    double *newCentroidCursor; /* pointer in clusterSum array*/
-    double *clusterSumEnd;     /* end of clusterSum, for loops*/
-    double *oldCentroidCursor; /* pointer in centroid*/
-    double dist;
-    clusterSumEnd = clusterSum + d;
-    /* divide sum by cluster size to get new centroid*/
-    for (newCentroidCursor = clusterSum; newCentroidCursor < clusterSumEnd; ++newCentroidCursor)
+    static char *kwlist[] = {"k", "n", "d", "dataPoints", "seed", "n_threads", "method", "chain_length", NULL};
+    int k, n, d;
+    PyObject *dataPoints;
+    PyObject *ret;
+    double *points;
+    float *singlePoints = NULL; /* the points when they are read in place from a float32 buffer*/
+    double *centroids;
+    int *choices;
+    double *minDists;
+    Py_buffer view;
+    char viewType;
+    unsigned long seed = 0;
+    int threadCount = 1;
+    char *methodName = "kmeans++";
+    int method;
+    int chainLength = AFKMC2_CHAIN_LENGTH;
+    int failed;
+    ParallelSeeding parallelSeeding;
+    ThreadPool pool;
+    Arena arena;
+    FitSignals signals;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iiiO|$kisi", kwlist, &k, &n, &d, &dataPoints, &seed, &threadCount, &methodName, &chainLength))
     {
-        *newCentroidCursor = *newCentroidCursor / clusterQty;
+        PyErr_SetString(PyExc_ValueError, "");
+        return NULL;
     }
-    dist = eucDist(clusterSum, centroid, d); /* for convergence condition*/
-    /* copy new centroid to new centroid array*/
-    for (newCentroidCursor = clusterSum, oldCentroidCursor = centroid;
-         newCentroidCursor < clusterSumEnd; ++newCentroidCursor, ++oldCentroidCursor)
+    method = initFromName(methodName);
+    /* k-means++ picks k distinct points*/
+    if (k < 1 || k > n || d < 1 || threadCount < 1 || method < 0 || method == INIT_FIRST || chainLength < 1 ||
+        countValues(dataPoints) != (Py_ssize_t)n * d)
     {
-        *oldCentroidCursor = *newCentroidCursor;
+        PyErr_SetString(PyExc_ValueError, "");
+        return NULL;
     }
-    return dist < epsilon;
+    /* float64 and float32 buffers are read in place, lists are copied into the arena*/
+    viewType = getValuesBuffer(dataPoints, &view, (Py_ssize_t)n * d);
+    arenaInit(&arena);
+    if (setupSeeding(&arena, &points, &centroids, &choices, &minDists, method == INIT_KMEANS_PARALLEL ? &parallelSeeding : NULL, k, n, d, viewType == 0) ||
+        (viewType == 0 && readValues(dataPoints, points, NULL, (Py_ssize_t)n * d)))
+    {
+        arenaRelease(&arena);
+        if (viewType != 0)
+        {
+            PyBuffer_Release(&view);
+        }
+        PyErr_SetString(PyExc_ValueError, "");
+        return NULL;
+    }
+    if (viewType == 'd')
+    {
+        points = (double *)view.buf;
+    }
+    else if (viewType == 'f')
+    {
+        singlePoints = (float *)view.buf;
+    }
+
+    threadCount = threadCount < n ? threadCount : n;
+    initFitSignals(&signals);
+    Py_BEGIN_ALLOW_THREADS
+    failed = threadCount > 1 && startThreadPool(&pool, threadCount);
+    if (!failed && method == INIT_KMEANS_PARALLEL)
+    {
+        seedKMeansParallel(points, singlePoints, centroids, choices, &parallelSeeding, k, n, d, seed, threadCount > 1 ? &pool : NULL, &signals);
+    }
+    else if (!failed && method == INIT_AFKMC2)
+    {
+        seedAfkMc2(points, singlePoints, centroids, choices, minDists, k, n, d, chainLength, seed, threadCount > 1 ? &pool : NULL, &signals);
+    }
+    else if (!failed)
+    {
+        seedKMeansPlusPlus(points, singlePoints, centroids, choices, minDists, NULL, k, n, d, seed, threadCount > 1 ? &pool : NULL, &signals);
+    }
+    if (!failed && threadCount > 1)
+    {
+        stopThreadPool(&pool);
+    }
+    Py_END_ALLOW_THREADS
+    pthread_mutex_destroy(&signals.lock);
+    if (failed || signals.interrupted)
+    {
+        arenaRelease(&arena);
+        if (viewType != 0)
+        {
+            PyBuffer_Release(&view);
+        }
+        /* an interrupted seeding raises the exception of the signal handler*/
+        if (!signals.interrupted)
+        {
+            PyErr_SetString(PyExc_ValueError, "");
+        }
+        return NULL;
+    }
+
+    /* the centroids are points of the input, so they are returned exactly (NULL with the error set if one fails)*/
+    ret = Py_BuildValue("(NN)", valuesToPython(centroids, (Py_ssize_t)k * d, "d"), valuesToPython(choices, k, "i"));
+    arenaRelease(&arena);
+    if (viewType != 0)
+    {
+        PyBuffer_Release(&view);
+    }
+    return ret;
 }
 
-void clearClusters(double *clusterSums, int *clusterQtys, int k, int d)
+void lockModel(KMeansModel *model)
 {
-    double *clusterSumsEnd; /* pointer to end of clusterSums array*/
-    int *clusterQtysEnd;    /* pointer to end of clusterQtysEnd*/
+    if (pthread_mutex_trylock(&model->lock) != 0)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&model->lock);
+        Py_END_ALLOW_THREADS
+    }
+}
 
-    clusterSumsEnd = clusterSums + k * d;
-    /* clearing clusterSums array*/
-    while (clusterSums < clusterSumsEnd)
+int layoutModel(KMeansModel *model, ModelLayout *layout, int points, int copyPoints)
+{
+    KMeansOptions layoutOptions;
+    int batches = layout == &model->batchLayout;
+
+    if (layout->capacity >= points && (layout->copiesPoints || !copyPoints))
     {
-        *(clusterSums++) = 0;
+        return 0;
+    }
+    points = points > layout->capacity ? points : layout->capacity;
+    copyPoints = copyPoints || (layout->capacity > 0 && layout->copiesPoints);
+    freeModelLayout(layout);
+    layoutOptions = model->options;
+    /* batches are assigned like mini-batches, one workspace-sized batch at most*/
+    layoutOptions.batchSize = batches ? points : 0;
+    if (setupWorkspace(&layout->ws, 1, &layout->arena, &layoutOptions, model->k, points, model->d, batches ? 1 : model->iter, copyPoints))
+    {
+        return 1;
     }
+    layout->capacity = points;
+    layout->copiesPoints = copyPoints;
+    return 0;
+}
 
-    clusterQtysEnd = clusterQtys + k;
-    /* clearing clusterQtys array*/
-    while (clusterQtys < clusterQtysEnd)
+void freeModelLayout(ModelLayout *layout)
+{
+    if (layout->capacity > 0)
     {
-        *(clusterQtys++) = 0;
+        freeKMeansState(&layout->ws.state);
+        layout->capacity = 0;
     }
 }
 
-int updateCentroids(double *centroids, double *clusterSums, int *clusterQtys, int k, int d, double epsilon)
+void computeDistancesGemm(double *dataPoints, double *distances, int k, int first, int last, int d, KMeansState *state, double *dots)
 {
-    int res = 1;
-    double *centroidsCursor = centroids;
-    double *clusterSumsCursor = clusterSums;
-    int *clusterQtysCursor = clusterQtys;
+    double *rows[GEMM_MR]; /* points of the current microkernel call*/
+    double dist;
+    int blockFirst;
+    int blockSize;
+    int centroidFirst;
+    int centroidCount;
+    int panelCount;
+    int depthFirst;
+    int depthLast;
     int i;
-    for (i = 0; i < k; i++)
-    {
-        /* update current centroid. Change res to false if current centroid does not*/
-        /* abide convergence condition in this iteration.*/
-        res = updateCentroid(centroidsCursor, clusterSumsCursor, *clusterQtysCursor, d, epsilon) && res;
+    int r;
+    int p;
+    int c;
 
-        /* advance cursors*/
-        centroidsCursor += d;
-        clusterSumsCursor += d;
-        clusterQtysCursor++;
+    /* blocked like computeClusterSumsGemm, keeping every distance instead of the closest centroid*/
+    for (blockFirst = first; blockFirst < last; blockFirst += GEMM_POINT_BLOCK)
+    {
+        blockSize = last - blockFirst < GEMM_POINT_BLOCK ? last - blockFirst : GEMM_POINT_BLOCK;
+        for (centroidFirst = 0; centroidFirst < k; centroidFirst += GEMM_CENTROID_BLOCK)
+        {
+            centroidCount = k - centroidFirst < GEMM_CENTROID_BLOCK ? k - centroidFirst : GEMM_CENTROID_BLOCK;
+            panelCount = (centroidCount + GEMM_NR - 1) / GEMM_NR;
+            for (i = 0; i < GEMM_POINT_BLOCK * GEMM_CENTROID_BLOCK; i++)
+            {
+                dots[i] = 0;
+            }
+            for (depthFirst = 0; depthFirst < d; depthFirst += GEMM_DEPTH_BLOCK)
+            {
+                depthLast = d - depthFirst < GEMM_DEPTH_BLOCK ? d : depthFirst + GEMM_DEPTH_BLOCK;
+                for (i = 0; i < blockSize; i += GEMM_MR)
+                {
+                    for (r = 0; r < GEMM_MR; r++)
+                    {
+                        rows[r] = &dataPoints[(size_t)(blockFirst + (i + r < blockSize ? i + r : blockSize - 1)) * d];
+                    }
+                    for (p = 0; p < panelCount; p++)
+                    {
+                        gemmKernel(rows, &state->packedCentroids[((size_t)centroidFirst / GEMM_NR + p) * d * GEMM_NR],
+                                   depthFirst, depthLast, &dots[i * GEMM_CENTROID_BLOCK + p * GEMM_NR], GEMM_CENTROID_BLOCK);
+                    }
+                }
+            }
+            for (i = 0; i < blockSize; i++)
+            {
+                for (c = 0; c < centroidCount; c++)
+                {
+                    dist = state->pointNorms[blockFirst + i] - 2 * dots[i * GEMM_CENTROID_BLOCK + c] + state->centroidNorms[centroidFirst + c];
+                    /* cancellation may leave a tiny negative value for a point on its centroid*/
+                    distances[(size_t)(blockFirst + i) * k + centroidFirst + c] = dist > 0 ? sqrt(dist) : 0;
+                }
+            }
+        }
     }
-    clearClusters(clusterSums, clusterQtys, k, d);
-    return res;
 }
 
-void updateClusters(double *vec, double *centroids, double *clusterSums, int *clusterQtys, int k, int d)
+void transformTask(void *taskArg, int threadIndex)
 {
-    /* Finding closest cluster*/
-    int closestCluster = 0;
-    double minDist = eucDist(vec, centroids, d);
-    double *centroidsCursor = &centroids[d];
-    double dist;
-    double *clusterSumsCursor;
-    double *vecCursor;
+    TransformJob *job = (TransformJob *)taskArg;
+    KMeansState *state = job->state;
+    int first = (int)((long)job->n * threadIndex / state->threadCount);
+    int last = (int)((long)job->n * (threadIndex + 1) / state->threadCount);
     int i;
-    for (i = 1; i < k; i++)
+    int c;
+
+    if (threadIndex >= state->threadCount)
     {
-        dist = eucDist(vec, centroidsCursor, d);
-        if (dist < minDist)
+        return;
+    }
+    if (state->algorithm == ALGORITHM_GEMM)
+    {
+        computeDistancesGemm(job->dataPoints, job->distances, job->k, first, last, job->d, state,
+                             &state->gemmDots[(size_t)threadIndex * (GEMM_POINT_BLOCK * GEMM_CENTROID_BLOCK + GEMM_POINT_BLOCK)]);
+        return;
+    }
+    /* eucDist uses the kernels of the Lloyd assignment*/
+    for (i = first; i < last; i++)
+    {
+        for (c = 0; c < job->k; c++)
         {
-            minDist = dist;
-            closestCluster = i; /* maintaining the closest cluster*/
+            job->distances[(size_t)i * job->k + c] = eucDist(&job->dataPoints[(size_t)i * job->d], &job->centroids[c * job->d], job->d);
         }
+    }
+}
 
-        centroidsCursor += d; /* updating centroidsCursor to the next centroid*/
+int countPoints(PyObject *values, int d)
+{
+    Py_ssize_t count = countValues(values);
+
+    if (d < 1 || count < d || count % d != 0 || count / d > INT_MAX)
+    {
+        return -1;
     }
+    return (int)(count / d);
+}
 
-    /* Now closestCluster is the index of the closest cluster.*/
-    /* We will proceed to update clusterSums and clusterQtys.*/
-    clusterQtys[closestCluster]++;
-    /* incrementing counter of elements in closest clusterv*/
-    clusterSumsCursor = &clusterSums[closestCluster * d]; /* now points to the start of the sum of data points in the closest cluster*/
-    /* adding current data points to sum of closest cluster*/
+double *getBatch(KMeansModel *model, PyObject *values, int *m, Py_buffer *view, Py_buffer **viewUsed)
+{
+    char viewType;
 
-    for (vecCursor = vec; vecCursor < &vec[d]; vecCursor++)
+    *viewUsed = NULL;
+    *m = countPoints(values, model->d);
+    if (*m < 0 || layoutModel(model, &model->batchLayout, *m, 0))
     {
-        *clusterSumsCursor += *vecCursor;
-        clusterSumsCursor++; /* progressing along cluster sum too*/
+        return NULL;
+    }
+    viewType = getValuesBuffer(values, view, (Py_ssize_t)*m * model->d);
+    if (viewType == 'd')
+    {
+        *viewUsed = view;
+        return (double *)view->buf;
+    }
+    if (viewType != 0)
+    {
+        PyBuffer_Release(view); /* float32 points are converted like lists*/
     }
+    return readValues(values, model->batchLayout.ws.batch, NULL, (Py_ssize_t)*m * model->d) ? NULL : model->batchLayout.ws.batch;
+}
 
-    /* the function is done, so will exit.*/
+PyObject *modelFailed(KMeansModel *model, Py_buffer *viewUsed)
+{
+    if (viewUsed != NULL)
+    {
+        PyBuffer_Release(viewUsed);
+    }
+    pthread_mutex_unlock(&model->lock);
+    PyErr_SetString(PyExc_ValueError, "");
+    return NULL;
 }
 
-void computeClusterSums(double *dataPoints, double *centroids, double *clusterSums, int *clusterQtys, int k, int n, int d)
+static PyObject *modelNew(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 {
-    double *dataPointsEnd = dataPoints + n * d; /* end of dataPoints array*/
-    while (dataPoints < dataPointsEnd)
+    KMeansModel *model = (KMeansModel *)type->tp_alloc(type, 0);
+
+    (void)args;
+    (void)kwargs;
+    if (model == NULL)
     {
-        /* for every data point, update the clusterSums*/
-        updateClusters(dataPoints, centroids, clusterSums, clusterQtys, k, d);
-        dataPoints += d;
+        return NULL;
     }
-    /* function is done, so will return*/
+    arenaInit(&model->fitLayout.arena);
+    arenaInit(&model->batchLayout.arena);
+    model->pool.threadCount = 1;
+    pthread_mutex_init(&model->lock, NULL);
+    return (PyObject *)model;
 }
 
-double *KMeans(int k, int n, int d, int iter, double *initialCentroids, double *dataPoints, double epsilon)
+static int modelInit(KMeansModel *self, PyObject *args, PyObject *kwargs)
 {
-    double *clusterSums;
-    int *clusterQtys;
+    static char *kwlist[] = {"k", "d", "iter", "epsilon", "initialCentroids", "algorithm", "n_threads", "deterministic", NULL};
+    int k, d;
+    int iter = 300;
+    double epsilon = 0;
+    PyObject *initialCentroids = Py_None;
+    char *algorithmName = "lloyd";
+    KMeansOptions options;
     double *centroids;
-    int i; /* for counting algorithm iterations */
+    long *centroidCounts;
+    int failed = 0;
 
-    if (dataPoints == NULL)
+    options.threadCount = 1;
+    options.deterministic = 0;
+    options.batchSize = 0;
+    options.seed = 0;
+    options.singlePrecision = 0;
+    options.blockedLayout = 0;
+    options.incremental = 0;
+    options.hugePages = 0;
+    options.restarts = 1;
+    options.keepLabels = 1; /* predict reads the labels, fit counts the points of every centroid with them*/
+    options.keepEmptyClusters = 1; /* a warm start on a batch that misses some centroids must not lose them*/
+    options.signals = NULL;
+    options.pool = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ii|id$Osip", kwlist, &k, &d, &iter, &epsilon, &initialCentroids,
+                                     &algorithmName, &options.threadCount, &options.deterministic))
     {
         PyErr_SetString(PyExc_ValueError, "");
-        return NULL;
+        return -1;
     }
-    centroids = initialCentroids;
-    if (centroids == NULL)
+    options.algorithm = algorithmFromName(algorithmName);
+    if (k < 1 || d < 1 || iter < 1 || options.algorithm < 0 || options.threadCount < 1 ||
+        (initialCentroids != Py_None && countValues(initialCentroids) != (Py_ssize_t)k * d))
     {
         PyErr_SetString(PyExc_ValueError, "");
-        return NULL;
+        return -1;
     }
-    clusterSums = (double *)calloc(k * d, sizeof(double)); /* sum of data points in each cluster*/
-    if (clusterSums == NULL)
+    centroids = (double *)malloc((size_t)k * d * sizeof(double));
+    centroidCounts = (long *)calloc(k, sizeof(long));
+    if (centroids == NULL || centroidCounts == NULL ||
+        (initialCentroids != Py_None && readValues(initialCentroids, centroids, NULL, (Py_ssize_t)k * d)))
     {
+        free(centroids);
+        free(centroidCounts);
         PyErr_SetString(PyExc_ValueError, "");
-        return NULL;
+        return -1;
     }
-    clusterQtys = (int *)calloc(k, sizeof(int)); /* Quantity of data points in each cluster*/
-    if (clusterQtys == NULL)
+
+    lockModel(self);
+    freeModelLayout(&self->fitLayout);
+    freeModelLayout(&self->batchLayout);
+    if (self->pool.threadCount > 1)
     {
-        PyErr_SetString(PyExc_ValueError, "");
-        return NULL;
+        stopThreadPool(&self->pool);
     }
-    i = 0;
-    do
+    /* both layouts run on these threads for the lifetime of the model*/
+    if (options.threadCount > 1)
+    {
+        failed = startThreadPool(&self->pool, options.threadCount);
+        options.pool = failed ? NULL : &self->pool;
+    }
+    free(self->centroids);
+    free(self->centroidCounts);
+    self->k = k;
+    self->d = d;
+    self->iter = iter;
+    self->epsilon = epsilon;
+    self->options = options;
+    self->centroids = centroids;
+    self->centroidCounts = centroidCounts;
+    self->fitted = initialCentroids != Py_None;
+    self->inertia = 0;
+    self->iterations = 0;
+    pthread_mutex_unlock(&self->lock);
+    if (failed)
     {
-        computeClusterSums(dataPoints, centroids, clusterSums, clusterQtys, k, n, d);
-    } while (++i < iter && !updateCentroids(centroids, clusterSums, clusterQtys, k, d, epsilon));
+        PyErr_SetString(PyExc_ValueError, "");
+        return -1;
+    }
+    return 0;
+}
 
-    free(clusterSums);
-    free(clusterQtys);
-    return centroids;
+static void modelDealloc(KMeansModel *self)
+{
+    freeModelLayout(&self->fitLayout);
+    freeModelLayout(&self->batchLayout);
+    if (self->pool.threadCount > 1)
+    {
+        stopThreadPool(&self->pool);
+    }
+    arenaRelease(&self->fitLayout.arena);
+    arenaRelease(&self->batchLayout.arena);
+    free(self->centroids);
+    free(self->centroidCounts);
+    pthread_mutex_destroy(&self->lock);
+    Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
-static PyObject *k_means_wrapper(PyObject *self, PyObject *args)
+static PyObject *modelFit(KMeansModel *self, PyObject *args, PyObject *kwargs)
 {
-    int k, n, d, iter;
-    PyObject *initialCentroids, *dataPoints;
-    PyObject *initialCentroidsItem, *dataPointsItem;
-    int initialCentroidsLength;
-    int dataPointsLength;
-    PyObject *ret;
-    PyObject *python_float;
-    double *initialCentroidsArray;
-    double *dataPointsArray;
-    double num;
-    double epsilon;
-    char formatted_str[100];
+    static char *kwlist[] = {"dataPoints", "initialCentroids", NULL};
+    PyObject *dataPoints;
+    PyObject *initialCentroids = Py_None;
+    Py_buffer view;
+    Py_buffer *viewUsed = NULL; /* &view iff the points are read in place from the buffer of dataPoints*/
+    char viewType;
+    double *points = NULL;
+    Workspace *ws = &self->fitLayout.ws;
+    KMeansOptions options;
+    FitSignals signals;
+    int k, n, d;
+    int i;
 
-    if (!PyArg_ParseTuple(args, "iiiidOO", &k, &n, &d, &iter, &epsilon, &initialCentroids, &dataPoints))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist, &dataPoints, &initialCentroids))
     {
         PyErr_SetString(PyExc_ValueError, "");
         return NULL;
     }
-    initialCentroidsLength = PyObject_Length(initialCentroids);
-    dataPointsLength = PyObject_Length(dataPoints);
-    if (initialCentroidsLength < 0 || dataPointsLength < 0)
+    lockModel(self);
+    k = self->k;
+    d = self->d;
+    n = countPoints(dataPoints, d);
+    viewType = n > 0 ? getValuesBuffer(dataPoints, &view, (Py_ssize_t)n * d) : 0;
+    if (viewType == 'd')
+    {
+        viewUsed = &view;
+        points = (double *)view.buf;
+    }
+    else if (viewType != 0)
+    {
+        PyBuffer_Release(&view);
+    }
+    /* the fit starts from initialCentroids if given, else from the centroids of the model, else from the first k points*/
+    if (n < 0 || (initialCentroids != Py_None && countValues(initialCentroids) != (Py_ssize_t)k * d) ||
+        (initialCentroids == Py_None && !self->fitted && n < k) || layoutModel(self, &self->fitLayout, n, viewUsed == NULL) ||
+        (viewUsed == NULL && readValues(dataPoints, ws->dataPoints, NULL, (Py_ssize_t)n * d)) ||
+        (initialCentroids != Py_None && readValues(initialCentroids, ws->centroids, NULL, (Py_ssize_t)k * d)))
+    {
+        return modelFailed(self, viewUsed);
+    }
+    points = viewUsed != NULL ? points : ws->dataPoints;
+    if (initialCentroids == Py_None)
+    {
+        memcpy(ws->centroids, self->fitted ? self->centroids : points, (size_t)k * d * sizeof(double));
+    }
+    clearClusters(ws->clusterSums, ws->clusterQtys, k, d);
+    restartKMeansState(&ws->state, k, n, d);
+    ws->state.boundsReady = 0; /* the points may be new, so norms and trees are built again too*/
+
+    initFitSignals(&signals);
+    options = self->options;
+    options.signals = &signals;
+    Py_BEGIN_ALLOW_THREADS
+    KMeans(k, n, d, self->iter, points, NULL, self->epsilon, ws, &options);
+    Py_END_ALLOW_THREADS
+    pthread_mutex_destroy(&signals.lock);
+    if (signals.interrupted)
+    {
+        /* the model keeps its centroids and the exception of the signal handler is raised*/
+        if (viewUsed != NULL)
+        {
+            PyBuffer_Release(viewUsed);
+        }
+        pthread_mutex_unlock(&self->lock);
+        return NULL;
+    }
+
+    /* partial_fit goes on from the points of the last assignment step*/
+    memcpy(self->centroids, ws->centroids, (size_t)k * d * sizeof(double));
+    memset(self->centroidCounts, 0, k * sizeof(long));
+    for (i = 0; i < n; i++)
+    {
+        self->centroidCounts[ws->state.labels[i]]++;
+    }
+    self->inertia = ws->trace.inertias[ws->trace.iterations - 1];
+    self->iterations = ws->trace.iterations;
+    self->fitted = 1;
+    if (viewUsed != NULL)
+    {
+        PyBuffer_Release(viewUsed);
+    }
+    pthread_mutex_unlock(&self->lock);
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *modelPartialFit(KMeansModel *self, PyObject *args)
+{
+    PyObject *batch;
+    Py_buffer view;
+    Py_buffer *viewUsed;
+    double *points;
+    Workspace *ws = &self->batchLayout.ws;
+    int m;
+
+    if (!PyArg_ParseTuple(args, "O", &batch))
     {
         PyErr_SetString(PyExc_ValueError, "");
         return NULL;
     }
-    initialCentroidsArray = (double *)malloc(initialCentroidsLength * sizeof(double));
-    dataPointsArray = (double *)malloc(dataPointsLength * sizeof(double));
-    if (initialCentroidsArray == NULL || dataPointsArray == NULL)
+    lockModel(self);
+    points = getBatch(self, batch, &m, &view, &viewUsed);
+    if (points == NULL || (!self->fitted && m < self->k))
+    {
+        return modelFailed(self, viewUsed);
+    }
+    if (!self->fitted)
+    {
+        /* without initial centroids the first batch starts from its first k points*/
+        memcpy(self->centroids, points, (size_t)self->k * self->d * sizeof(double));
+        self->fitted = 1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ws->state.boundsReady = 0; /* new points, GEMM recomputes their norms*/
+    assignPoints(points, self->centroids, ws->clusterSums, ws->clusterQtys, self->k, m, self->d, &ws->state);
+    /* every centroid stays the mean of all points it was fitted to*/
+    updateCentroidsMiniBatch(self->centroids, ws->clusterSums, ws->clusterQtys, self->centroidCounts, self->k, self->d, ws->state.centroidDeltas);
+    Py_END_ALLOW_THREADS
+    if (viewUsed != NULL)
+    {
+        PyBuffer_Release(viewUsed);
+    }
+    pthread_mutex_unlock(&self->lock);
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *modelPredict(KMeansModel *self, PyObject *args)
+{
+    PyObject *dataPoints;
+    PyObject *ret;
+    Py_buffer view;
+    Py_buffer *viewUsed = NULL;
+    double *points = NULL;
+    Workspace *ws = &self->batchLayout.ws;
+    int m;
+
+    if (!PyArg_ParseTuple(args, "O", &dataPoints))
     {
-        free(initialCentroidsArray);
-        free(dataPointsArray);
         PyErr_SetString(PyExc_ValueError, "");
         return NULL;
     }
-    for (int i = 0; i < initialCentroidsLength; i++)
+    lockModel(self);
+    if (!self->fitted || (points = getBatch(self, dataPoints, &m, &view, &viewUsed)) == NULL)
     {
-        initialCentroidsItem = PyList_GetItem(initialCentroids, i);
-        num = PyFloat_AsDouble(initialCentroidsItem);
-        if (num == -1 && PyErr_Occurred())
-        {
-            free(initialCentroidsArray);
-            free(dataPointsArray);
-            PyErr_SetString(PyExc_ValueError, "");
-            return NULL;
-        }
-        initialCentroidsArray[i] = num;
+        return modelFailed(self, viewUsed);
     }
-    for (int i = 0; i < dataPointsLength; i++)
+
+    Py_BEGIN_ALLOW_THREADS
+    ws->state.boundsReady = 0;
+    assignPoints(points, self->centroids, ws->clusterSums, ws->clusterQtys, self->k, m, self->d, &ws->state);
+    clearClusters(ws->clusterSums, ws->clusterQtys, self->k, self->d); /* only the labels are kept*/
+    Py_END_ALLOW_THREADS
+    ret = valuesToPython(ws->state.labels, m, "i");
+    if (viewUsed != NULL)
     {
-        dataPointsItem = PyList_GetItem(dataPoints, i);
-        num = PyFloat_AsDouble(dataPointsItem);
-        if (num == -1 && PyErr_Occurred())
-        {
-            free(initialCentroidsArray);
-            free(dataPointsArray);
-            PyErr_SetString(PyExc_ValueError, "");
-            return NULL;
-        }
-        dataPointsArray[i] = num;
+        PyBuffer_Release(viewUsed);
     }
+    pthread_mutex_unlock(&self->lock);
+    return ret;
+}
+
+static PyObject *modelTransform(KMeansModel *self, PyObject *args)
+{
+    PyObject *dataPoints;
+    PyObject *ret;
+    Py_buffer view;
+    Py_buffer *viewUsed = NULL;
+    double *points = NULL;
+    double *distances = NULL;
+    KMeansState *state = &self->batchLayout.ws.state;
+    TransformJob job;
+    int k = self->k;
+    int m;
 
-    double *result = KMeans(k, n, d, iter, initialCentroidsArray, dataPointsArray, epsilon);
-    if (result == NULL)
+    if (!PyArg_ParseTuple(args, "O", &dataPoints))
     {
-        free(initialCentroidsArray);
-        free(dataPointsArray);
         PyErr_SetString(PyExc_ValueError, "");
         return NULL;
     }
+    lockModel(self);
+    if (!self->fitted || (points = getBatch(self, dataPoints, &m, &view, &viewUsed)) == NULL ||
+        (distances = (double *)malloc((size_t)m * k * sizeof(double))) == NULL)
+    {
+        return modelFailed(self, viewUsed);
+    }
+
+    job.dataPoints = points;
+    job.centroids = self->centroids;
+    job.distances = distances;
+    job.k = k;
+    job.n = m;
+    job.d = self->d;
+    job.state = state;
+    Py_BEGIN_ALLOW_THREADS
+    state->boundsReady = 0; /* GEMM computes the norms of the new points*/
+    prepareAssignment(points, self->centroids, k, m, self->d, state);
+    if (state->threadCount > 1)
+    {
+        runOnThreadPool(state->pool, transformTask, &job);
+    }
+    else
+    {
+        transformTask(&job, 0);
+    }
+    Py_END_ALLOW_THREADS
+    ret = valuesToPython(distances, (Py_ssize_t)m * k, "d");
+    free(distances);
+    if (viewUsed != NULL)
+    {
+        PyBuffer_Release(viewUsed);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return ret;
+}
 
-    /* return result to python */
-    ret = PyList_New(k * d);
+static PyObject *modelCentroids(KMeansModel *self, void *closure)
+{
+    PyObject *ret;
 
-    for (int i = 0; i < k * d; i++)
+    (void)closure;
+    lockModel(self);
+    if (!self->fitted)
     {
-        snprintf(formatted_str, sizeof(formatted_str), "%.4f", result[i]);
-        double formatted_double = strtod(formatted_str, NULL); // Convert the formatted string back to double
-        python_float = PyFloat_FromDouble(formatted_double);
-        PyList_SetItem(ret, i, python_float);
+        pthread_mutex_unlock(&self->lock);
+        Py_RETURN_NONE;
     }
-    free(initialCentroidsArray);
-    free(dataPointsArray);
+    ret = valuesToPython(self->centroids, (Py_ssize_t)self->k * self->d, "d");
+    pthread_mutex_unlock(&self->lock);
     return ret;
 }
 
+static PyMethodDef modelMethods[] = {
+    {"fit", (PyCFunction)(void (*)(void))modelFit, METH_VARARGS | METH_KEYWORDS,
+     "Run k-means on all points, starting from the centroids of the model \nInput: dataPoints (n * d float list, or a C contiguous float64 "
+     "or float32 buffer, float64 is read in place) \nKeywords: initialCentroids=None (k * d values to start from instead; before the first fit "
+     "or partial_fit without them the fit starts from the first k points) \nReturns : the model"},
+    {"partial_fit", (PyCFunction)modelPartialFit, METH_VARARGS,
+     "Assign a batch of points to the centroids and move every centroid to the mean of all points it was fitted to so far \n"
+     "Input: batch (m * d values, as for fit; the first batch without centroids starts from its first k points) \nReturns : the model"},
+    {"predict", (PyCFunction)modelPredict, METH_VARARGS,
+     "Input: dataPoints (m * d values, as for fit) \nReturns : labels(m int32 values, the closest centroid of every point)"},
+    {"transform", (PyCFunction)modelTransform, METH_VARARGS,
+     "Input: dataPoints (m * d values, as for fit) \nReturns : distances(m * k float64 values, from every point to every centroid)"},
+    {NULL, NULL, 0, NULL}};
+
+static PyMemberDef modelMembers[] = {
+    {"k", T_INT, offsetof(KMeansModel, k), READONLY, "number of centroids"},
+    {"d", T_INT, offsetof(KMeansModel, d), READONLY, "dimension of the points"},
+    {"inertia", T_DOUBLE, offsetof(KMeansModel, inertia), READONLY, "inertia of the last assignment step of the last fit"},
+    {"n_iter", T_INT, offsetof(KMeansModel, iterations), READONLY, "assignment steps run by the last fit"},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyGetSetDef modelGetSet[] = {
+    {"centroids", (getter)modelCentroids, NULL, "k * d float64 values (a copy), or None before the first fit", NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyTypeObject KMeansModelType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "mykmeanssp.KMeans",
+    .tp_basicsize = sizeof(KMeansModel),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "k-means model keeping its centroids and workspace between calls, for many fits or small batches \n"
+              "Input: int k, int d, int iter=300, float epsilon=0 (as for fit) \n"
+              "Keywords: initialCentroids=None (k * d values to start from), algorithm='lloyd', n_threads=1, deterministic=False (as for fit; "
+              "partial_fit, predict and transform assign with Lloyd unless algorithm is 'gemm') \n"
+              "Calls on one model run one at a time, without the GIL",
+    .tp_new = modelNew,
+    .tp_init = (initproc)modelInit,
+    .tp_dealloc = (destructor)modelDealloc,
+    .tp_methods = modelMethods,
+    .tp_members = modelMembers,
+    .tp_getset = modelGetSet,
+};
+
 static PyMethodDef kmeansMethods[] = {
     {
         "fit",                                                                                                                                                                                                       /*name exposed to Python*/
-        k_means_wrapper,                                                                                                                                                                                             /* C wrapper function */
-        METH_VARARGS,                                                                                                                                                                                                /* received variable args */
-        "Calculate kmeans clusters given initial centroids \nInput: int k, int n, int d, int iter, float epsilon, list_of_float initialCentroids, list_of_float dataPoints) \n Returns : centoids(k *d float list) " /* documentation */
+        (PyCFunction)(void (*)(void))k_means_wrapper,                                                                                                                                                                /* C wrapper function */
+        METH_VARARGS | METH_KEYWORDS,                                                                                                                                                                                /* received variable args and keywords */
+        "Calculate kmeans clusters given initial centroids \nInput: int k, int n, int d, int iter, float epsilon, list_of_float initialCentroids, list_of_float dataPoints) \n"
+        "initialCentroids and dataPoints may also be C contiguous float64 or float32 buffers (NumPy arrays, memoryviews, np.memmap), dataPoints is then read in place \n"
+        "Keywords: algorithm='lloyd' | 'elkan' | 'hamerly' | 'accelerated' (Elkan for small k, Hamerly for large k) | 'yinyang' (for very large k) | 'gemm' (for high dimensions) | 'kdtree' (for low dimensions and large n), \n"
+        "n_threads=1 (threads sharing the assignment step), \n"
+        "deterministic=False (True gives bit identical results for any n_threads), \n"
+        "batch_size=0 (mini-batch k-means on random batches of this many points, iter counts batches), \n"
+        "seed=0 (seed of the mini-batch sampler and of the random initial centroids of every fit after the first with n_init), \n"
+        "float32=False (True compares points and centroids in single precision, implied when dataPoints is a float32 buffer), \n"
+        "layout='rows' | 'blocked' (Lloyd on points packed in blocks of 8, vectorized across points, for low dimensions), \n"
+        "incremental=False (True keeps the cluster sums between iterations, updates them only for points that changed cluster and stops once none did), \n"
+        "hugepages=False (True backs the workspace with huge pages), \n"
+        "n_init=1 (independent fits run concurrently on the threads, the one with the lowest inertia is returned.\n"
+        "  initialCentroids holds k centroids for the first fit, the others start from random points, or k centroids for every fit) \n"
+        "full_output=False (True also returns the labels, inertia and a trace of the last assignment step, not with batch_size) \n"
+        "The GIL is released while the fit runs, so fits from several Python threads run at once, and Ctrl-C stops it \n"
+        "Returns : centroids(k * d float64 values in full precision, a NumPy array, or a memoryview without NumPy), \n"
+        "  with full_output (centroids, labels(n int32 values, cluster of every point in the last assignment step),\n"
+        "  inertia(of that step, against the centroids it compared with, which the returned ones moved less than epsilon away from),\n"
+        "  n_iter(assignment steps run), inertia_trace(n_iter float64 values), shift_trace(n_iter float64 values, largest centroid\n"
+        "  movement after every step, 0 after the last one unless it converged)) " /* documentation */
+    },
+    {
+        "kmeans_pp",
+        (PyCFunction)(void (*)(void))k_means_pp_wrapper,
+        METH_VARARGS | METH_KEYWORDS,
+        "Pick initial centroids with k-means++ \nInput: int k, int n, int d, list_of_float dataPoints (or a C contiguous float64 or float32 buffer, read in place) \n"
+        "Keywords: seed=0 (seed of the sampler, the picks do not depend on n_threads), \n"
+        "n_threads=1 (threads sharing the distance updates), \n"
+        "method='kmeans++' | 'kmeans||' (a few parallel oversampling rounds, then k-means++ over the weighted samples, for large k)\n"
+        "  | 'afkmc2' (one pass, then a Markov chain per centroid, for large n), \n"
+        "chain_length=200 (afkmc2: proposals per centroid) \n"
+        "Returns : (centroids(k * d float64 values), indices of the points picked(k int32 values)), NumPy arrays, or memoryviews without NumPy"
     },
     {NULL, NULL, 0, NULL}};
 
@@ -304,17 +5549,33 @@ static struct PyModuleDef kmeansmodule = {
     "mykmeanssp", /* name of module */
     NULL,         /* module documentation, may be NULL */
     -1,           /* size of per-interpreter state of the module, or -1 if the module keeps state in global variables. */
-    kmeansMethods /* the PyMethodDef array from before containing the methods of the extension */
+    kmeansMethods, /* the PyMethodDef array from before containing the methods of the extension */
+    NULL,
+    NULL,
+    NULL,
+    freeModule /* unmaps the workspace kept between fits */
 };
 
 PyMODINIT_FUNC PyInit_mykmeanssp(void)
 {
     PyObject *m;
+    selectDistanceKernel();
+    if (PyType_Ready(&KMeansModelType) < 0)
+    {
+        return NULL;
+    }
     m = PyModule_Create(&kmeansmodule);
     if (m == NULL)
     {
         PyErr_SetString(PyExc_ValueError, "");
         return NULL;
     }
+    Py_INCREF(&KMeansModelType);
+    if (PyModule_AddObject(m, "KMeans", (PyObject *)&KMeansModelType) < 0)
+    {
+        Py_DECREF(&KMeansModelType);
+        Py_DECREF(m);
+        return NULL;
+    }
     return m;
 }
@@ -0,0 +1,81 @@
+"""
+Checks the inertia reported by mykmeanssp against a direct sum over the points,
+and that a KMeans model keeps the centroids a warm started fit assigns no points to.
+Build the extension first (python3 setup.py build_ext --inplace) and run from HW2: python3 tests/test_inertia.py
+"""
+import numpy as np
+import mykmeanssp as km
+
+ALGORITHMS = ['lloyd', 'elkan', 'hamerly', 'yinyang', 'gemm', 'kdtree']
+
+
+def report(name, failure):
+    if failure:
+        print("\033[1;31m%s: %s\033[0m" % (name, failure))
+        print("\033[1;31m\033[1mTEST FAIL\033[0m")
+    else:
+        print("\033[1;32m\033[1mTEST PASS\033[0m")
+
+
+def direct_inertia(points, centroids, labels):
+    return float(((points - centroids[labels]) ** 2).sum())
+
+
+def tight_far_clusters(rng, k, n, d):
+    """k < 2 ** d clusters at distinct corners of [-1e6, 1e6] ** d with noise 1e-3, where the inertia
+    is tiny next to the spread of the points."""
+    centers = 1e6 * (2 * ((np.arange(k)[:, None] >> np.arange(d)) & 1) - 1).astype(float)
+    labels = np.arange(n) % k
+    return centers[labels] + rng.normal(scale=1e-3, size=(n, d)), centers
+
+
+def check_fit(points, centers, **kwargs):
+    n, d = points.shape
+    k = len(centers)
+    centroids, labels, inertia, n_iter, inertias, shifts = km.fit(k, n, d, 10, 0.0, centers, points,
+                                                                 full_output=True, **kwargs)
+    expected = direct_inertia(points, np.asarray(centroids).reshape(k, d), np.asarray(labels))
+    if not abs(inertia - expected) <= 1e-9 * expected:
+        return "inertia %r, direct sum %r" % (inertia, expected)
+    if inertias[-1] != inertia:
+        return "last traced inertia %r differs from inertia %r" % (inertias[-1], inertia)
+    return None
+
+
+def main():
+    rng = np.random.default_rng(4)
+    k, n, d = 4, 4000, 3
+    points, centers = tight_far_clusters(rng, k, n, d)
+    for algorithm in ALGORITHMS:
+        print("Checking the inertia of fit with algorithm=%s on tight clusters far apart..." % algorithm)
+        report(algorithm, check_fit(points, centers, algorithm=algorithm))
+    print("Checking the inertia of fit with n_init=3...")
+    report("n_init", check_fit(points, centers, n_init=3, n_threads=2))
+
+    print("Checking KMeans.inertia on tight clusters far apart...")
+    model = km.KMeans(k, d, 10, 0.0, initialCentroids=centers)
+    model.fit(points)
+    expected = direct_inertia(points, np.asarray(model.centroids).reshape(k, d), np.asarray(model.predict(points)))
+    report("KMeans", None if abs(model.inertia - expected) <= 1e-9 * expected else
+           "inertia %r, direct sum %r" % (model.inertia, expected))
+
+    print("Checking KMeans.fit warm started on points of a single cluster...")
+    for batch in range(5):
+        model.partial_fit(points[rng.choice(n, 200)])
+    single = points[np.arange(n) % k == 0][:50]
+    model.fit(single)
+    centroids = np.asarray(model.centroids).reshape(k, d)
+    expected = direct_inertia(single, centroids, np.asarray(model.predict(single)))
+    if np.isnan(centroids).any():
+        failure = "centroids without points became NaN"
+    elif not (np.asarray(model.predict(points)) == np.arange(n) % k).all():
+        failure = "the other clusters were lost"
+    elif not abs(model.inertia - expected) <= 1e-9 * expected:
+        failure = "inertia %r, direct sum %r" % (model.inertia, expected)
+    else:
+        failure = None
+    report("KMeans warm start", failure)
+
+
+if __name__ == '__main__':
+    main()